@@ -5,7 +5,273 @@
 */
 
 #include "netfunc.h"
+#include <algorithm>
 #include <chrono>
+#include <cstdio>
+#include <functional>
+#include <iterator>
+#include <random>
+
+// netfunc BufferPool definitions
+namespace netfunc
+{
+	namespace
+	{
+		// size classes go from 64 bytes to 128 KiB, enough for a full frame and its header
+		const uint32_t poolMinShift = 6;
+		const uint32_t poolClassCount = 12;
+		const size_t poolThreadKeep = 8;
+		const size_t poolSharedKeep = 64;
+
+		uint32_t HelperPoolClass(uint32_t sizeBytes)
+		{
+			uint32_t sizeClass = 0;
+			while(sizeClass < poolClassCount && (uint32_t(1) << (sizeClass + poolMinShift)) < sizeBytes)
+				++sizeClass;
+			return sizeClass;
+		}
+
+		struct SharedPool
+		{
+			std::mutex lock;
+			std::vector<char*> free[poolClassCount];
+		};
+
+		SharedPool &GetSharedPool(void)
+		{
+			// never destroyed, detached threads can still be returning buffers while the program exits
+			static SharedPool *pool = new SharedPool();
+			return *pool;
+		}
+
+		struct ThreadPool
+		{
+			std::vector<char*> free[poolClassCount];
+
+			~ThreadPool()
+			{
+				// hand what this thread kept to the shared lists
+				SharedPool &shared = GetSharedPool();
+				std::lock_guard<std::mutex> guard(shared.lock);
+				for(uint32_t sizeClass = 0; sizeClass < poolClassCount; ++sizeClass)
+				{
+					for(char *buffer : free[sizeClass])
+					{
+						if(shared.free[sizeClass].size() < poolSharedKeep)
+							shared.free[sizeClass].push_back(buffer);
+						else
+							delete[] buffer;
+					}
+				}
+			}
+		};
+
+		ThreadPool &GetThreadPool(void)
+		{
+			static thread_local ThreadPool pool;
+			return pool;
+		}
+	}
+
+	// Gets a buffer that can hold at least sizeBytes.
+	std::unique_ptr<char[]> BufferPool::Acquire(uint32_t sizeBytes)
+	{
+		uint32_t sizeClass = HelperPoolClass(sizeBytes);
+		if(sizeClass == poolClassCount)
+			return std::unique_ptr<char[]>(new char[sizeBytes]);
+
+		std::vector<char*> &local = GetThreadPool().free[sizeClass];
+		if(local.empty())
+		{
+			// refill half of this thread's cache from the shared list in one go
+			SharedPool &shared = GetSharedPool();
+			std::lock_guard<std::mutex> guard(shared.lock);
+			std::vector<char*> &sharedFree = shared.free[sizeClass];
+			while(!sharedFree.empty() && local.size() < poolThreadKeep / 2)
+			{
+				local.push_back(sharedFree.back());
+				sharedFree.pop_back();
+			}
+		}
+
+		if(local.empty())
+			return std::unique_ptr<char[]>(new char[size_t(1) << (sizeClass + poolMinShift)]);
+		std::unique_ptr<char[]> buffer(local.back());
+		local.pop_back();
+		return buffer;
+	}
+
+	// Gives back a buffer from Acquire, sizeBytes must be the size it was acquired with.
+	// The buffer is empty after this call.
+	void BufferPool::Release(std::unique_ptr<char[]> &buffer, uint32_t sizeBytes)
+	{
+		uint32_t sizeClass = HelperPoolClass(sizeBytes);
+		if(!buffer || sizeClass == poolClassCount)
+		{
+			buffer.reset();
+			return;
+		}
+
+		std::vector<char*> &local = GetThreadPool().free[sizeClass];
+		if(local.size() < poolThreadKeep)
+		{
+			local.push_back(buffer.release());
+			return;
+		}
+
+		SharedPool &shared = GetSharedPool();
+		std::lock_guard<std::mutex> guard(shared.lock);
+		if(shared.free[sizeClass].size() < poolSharedKeep)
+			shared.free[sizeClass].push_back(buffer.release());
+		else
+			buffer.reset();
+	}
+}
+
+
+// netfunc ConnectionBase definitions
+namespace netfunc
+{
+	// Sends the parts as one message, the same way Send does. This is what netfunc uses to send, by default
+	//    the parts are gathered into one buffer and passed to Send.
+	bool ConnectionBase::SendParts(SendSpan const *parts, uint32_t partCount)
+	{
+		size_t sizeBytes = 0;
+		for(uint32_t i = 0; i < partCount; ++i)
+			sizeBytes += parts[i].sizeBytes;
+		if(sizeBytes > maxMessageBytes)
+			return false;
+
+		std::unique_ptr<char[]> buffer = BufferPool::Acquire(uint32_t(sizeBytes));
+		size_t offset = 0;
+		for(uint32_t i = 0; i < partCount; ++i)
+		{
+			std::memcpy(buffer.get() + offset, parts[i].data, parts[i].sizeBytes);
+			offset += parts[i].sizeBytes;
+		}
+		bool sent = Send(buffer, uint16_t(sizeBytes));
+		BufferPool::Release(buffer, uint32_t(sizeBytes));
+		return sent;
+	}
+
+	// Try to open connection to remote listener, giving up once timeoutSeconds have passed. This is what
+	//    netfunc uses to connect, by default it calls Connect and can't tell why it failed.
+	ErrorResult ConnectionBase::ConnectWithin(std::string const &address, uint16_t port, float)
+	{
+		return Connect(address, port) ? ErrorResult::Call_Ok : ErrorResult::Net_Error;
+	}
+
+	// Try to receive a message into a buffer owned by the caller, the same way Recv does. This is what
+	//    netfunc uses to receive, by default the buffer from Recv is copied into the caller's buffer.
+	bool ConnectionBase::RecvInto(char *buffer, uint32_t capacityBytes, uint16_t &outSizeBytes, bool &outReceived)
+	{
+		outSizeBytes = 0;
+		outReceived = false;
+
+		std::unique_ptr<char[]> received;
+		uint16_t receivedBytes = 0;
+		if(!Recv(received, receivedBytes))
+			return false;
+		if(!received)
+			return true;
+
+		bool fits = receivedBytes <= capacityBytes;
+		if(fits)
+		{
+			std::memcpy(buffer, received.get(), receivedBytes);
+			outSizeBytes = receivedBytes;
+			outReceived = true;
+		}
+		ReleaseBuffer(received, receivedBytes);
+		return fits;
+	}
+
+	// Try to receive a message without blocking at all. This is what the cooperative Update uses, by default
+	//    it calls RecvInto.
+	bool ConnectionBase::RecvAvailable(char *buffer, uint32_t capacityBytes, uint16_t &outSizeBytes, bool &outReceived)
+	{
+		return RecvInto(buffer, capacityBytes, outSizeBytes, outReceived);
+	}
+
+	bool SpanConnectionBase::Send(std::unique_ptr<char[]> const &inBuffer, uint16_t sizeBytes)
+	{
+		SendSpan part = { inBuffer.get(), sizeBytes };
+		return SendParts(&part, 1);
+	}
+
+	bool SpanConnectionBase::Recv(std::unique_ptr<char[]> &outBuffer, uint16_t &outSizeBytes)
+	{
+		outBuffer = BufferPool::Acquire(maxMessageBytes);
+		bool received = false;
+		bool good = RecvInto(outBuffer.get(), maxMessageBytes, outSizeBytes, received);
+		if(!received)
+			BufferPool::Release(outBuffer, maxMessageBytes);
+		return good;
+	}
+
+	void SpanConnectionBase::ReleaseBuffer(std::unique_ptr<char[]> &buffer, uint16_t)
+	{
+		BufferPool::Release(buffer, maxMessageBytes);
+	}
+}
+
+// buffer from the pool that goes back when it leaves scope
+namespace
+{
+	struct PooledBuffer
+	{
+		std::unique_ptr<char[]> buffer;
+		uint32_t capacityBytes;
+
+		PooledBuffer(uint32_t capacity) : buffer(netfunc::BufferPool::Acquire(capacity)), capacityBytes(capacity) {}
+		~PooledBuffer() { netfunc::BufferPool::Release(buffer, capacityBytes); }
+		PooledBuffer(PooledBuffer&) = delete;
+		void operator=(PooledBuffer&) = delete;
+	};
+
+	// how often waits for data or connections look at the flag that stops them
+	const int runningCheckMs = 10;
+
+	void WaitReadable(int handle, int waitMs);
+
+	// Waits for the next message on a connection.
+	// running : if not null, stop waiting once it turns false
+	// return : Request_Timeout if nothing came in time, Net_Error if the connection broke
+	netfunc::ErrorResult RecvMessage(netfunc::ConnectionBase &connection, PooledBuffer &received, uint16_t &sizeBytes,
+		float timeoutSeconds, std::atomic_bool const *running)
+	{
+		std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+		int handle = connection.PollHandle();
+		for(;;)
+		{
+			// check for timeout
+			std::chrono::steady_clock::time_point nowTime = std::chrono::steady_clock::now();
+			double waitedSeconds = std::chrono::duration_cast<std::chrono::duration<double>>(nowTime-startTime).count();
+			if((running && !*running) || waitedSeconds > timeoutSeconds)
+				return netfunc::ErrorResult::Request_Timeout;
+
+			// get data
+			bool gotData = false;
+			if(!connection.RecvInto(received.buffer.get(), received.capacityBytes, sizeBytes, gotData))
+				return netfunc::ErrorResult::Net_Error;
+			if(gotData)
+				return netfunc::ErrorResult::Call_Ok;
+
+			// wait for data to arrive instead of checking every millisecond, running is still looked at every few
+			//    milliseconds. Connections that can't be polled are checked every millisecond
+			if(handle >= 0)
+			{
+				int waitMs = int((timeoutSeconds - waitedSeconds) * 1000.0) + 1;
+				if(running)
+					waitMs = std::min(waitMs, runningCheckMs);
+				WaitReadable(handle, waitMs);
+			}
+			else
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+}
+
 
 // default string serialization functions
 namespace
@@ -22,7 +288,7 @@ namespace
 				// input is too big
 				return false;
 
-			outBuffer.reset(new char[input.size()]);
+			outBuffer = netfunc::BufferPool::Acquire(expectedSize);
 			if (!outBuffer)
 				// buffer did not allocate
 				return false;
@@ -51,581 +317,4328 @@ namespace
 			return false;
 		}
 	}
+
+	// Gives a buffer made by a serialization function back to the pool if it came from there.
+	void ReleaseSerialized(netfunc::StringSerializationType serializeFunction, std::unique_ptr<char[]> &buffer, uint16_t sizeBytes)
+	{
+		if(serializeFunction == DefaultStringSerialization)
+			netfunc::BufferPool::Release(buffer, sizeBytes);
+		else
+			buffer.reset();
+	}
+
+	// Passes the string through the serializer and sends it as one message.
+	// return : Bad_String if the serializer failed, Net_Error if the send failed
+	netfunc::ErrorResult SendString(netfunc::ConnectionBase &connection, netfunc::StringSerializationType serializeFunction,
+		std::string const &data)
+	{
+		std::unique_ptr<char[]> buffer;
+		uint16_t sizeBytes = 0;
+		if(!serializeFunction(data, buffer, sizeBytes))
+			return netfunc::ErrorResult::Bad_String;
+		netfunc::SendSpan part = { buffer.get(), sizeBytes };
+		bool sent = connection.SendParts(&part, 1);
+		ReleaseSerialized(serializeFunction, buffer, sizeBytes);
+		return sent ? netfunc::ErrorResult::Call_Ok : netfunc::ErrorResult::Net_Error;
+	}
+
+	// Makes the start of the response text out of the fields for one requester, up to where the result goes.
+	//    The result and a closing brace finish it.
+	// fields : json object with everything but the result
+	std::string HelperEnvelopePrefix(netfunc::json const &fields)
+	{
+		std::string prefix = fields.is_object() ? fields.dump() : "{}";
+		prefix.pop_back();
+		if(prefix.size() > 1)
+			prefix.push_back(',');
+		prefix += "\"result\":";
+		return prefix;
+	}
+
+	// Makes the response text out of the fields for one requester and a result that is already serialized, so a
+	//    stored result can be sent to any requester.
+	// fields : json object with everything but the result
+	// resultString : the result, serialized
+	std::string HelperEnvelope(netfunc::json const &fields, std::string const &resultString)
+	{
+		std::string envelope = HelperEnvelopePrefix(fields);
+		envelope += resultString;
+		envelope.push_back('}');
+		return envelope;
+	}
+
+	// marks a waiting connection that isn't queued for the cooperative Update
+	const size_t notQueued = ~size_t(0);
+
+	// heartbeats are not sent more often than this, and a requester gives up on a listener after this many are missed
+	const float minHeartbeatSeconds = 0.01f;
+	const float missedHeartbeats = 3.0f;
 };
 
 #if defined(__GNUC__)
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <netdb.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#endif
 // default connection class
 namespace
 {
-	class DefaultConnection : public netfunc::ConnectionBase
+	// sendfile has no MSG_NOSIGNAL, so SIGPIPE is held back for this thread while the scope is alive and any
+	//    SIGPIPE raised meanwhile is dropped, a requester that went away fails the send instead
+	class NoSigPipeScope
 	{
-		int mySocket = -1;
+		sigset_t pipeSet;
+		sigset_t oldSet;
+		bool wasPending;
 	public:
-		DefaultConnection() = default;
-		DefaultConnection(int in) : mySocket(in) {}
-
-		// Sets up the port and gets it ready to either connect or listen.
-		// port : the port to try to setup
-		// return : true if setup was successful, false if not
-		virtual bool Setup(uint16_t port) override
+		NoSigPipeScope()
 		{
-			mySocket = socket(AF_INET, SOCK_STREAM, 0);
-			if(mySocket < 0)
-				return false;
-			sockaddr_in sockAddr;
-			std::memset(&sockAddr, 0, sizeof(sockAddr));
-			sockAddr.sin_family = AF_INET;
-			sockAddr.sin_addr.s_addr = INADDR_ANY;
-			sockAddr.sin_port = htons(port);
-			if(bind(mySocket, reinterpret_cast<sockaddr*>(&sockAddr), sizeof(sockAddr)) < 0)
+			sigemptyset(&pipeSet);
+			sigaddset(&pipeSet, SIGPIPE);
+			sigset_t pending;
+			sigpending(&pending);
+			wasPending = sigismember(&pending, SIGPIPE) == 1;
+			pthread_sigmask(SIG_BLOCK, &pipeSet, &oldSet);
+		}
+		~NoSigPipeScope()
+		{
+			sigset_t pending;
+			sigpending(&pending);
+			if(!wasPending && sigismember(&pending, SIGPIPE) == 1)
 			{
-				close(mySocket);
-				mySocket = -1;
-				return false;
+				timespec noWait = { 0, 0 };
+				sigtimedwait(&pipeSet, nullptr, &noWait);
 			}
-			return true;
+			pthread_sigmask(SIG_SETMASK, &oldSet, nullptr);
 		}
+		NoSigPipeScope(NoSigPipeScope&) = delete;
+		void operator=(NoSigPipeScope&) = delete;
+	};
 
-		// Destroys the open connection.
-		virtual void Stop(void) override
+	// Resolves host names for the default connection. Addresses are kept for a while, once they are stale they
+	//    are still handed out while a lookup in the background refreshes them, so only the first connect to a
+	//    name waits on getaddrinfo. Failed lookups are kept for a short time too.
+	class AddressCache
+	{
+		static const size_t maxEntries = 1024;
+		struct Entry
 		{
-			close(mySocket);
+			// ports are left at 0
+			std::vector<sockaddr_storage> addresses;
+			std::chrono::steady_clock::time_point expireTime;
+			bool resolved = false;
+			bool resolving = false;
+		};
+		std::mutex lock;
+		std::condition_variable resolvedSignal;
+		std::unordered_map<std::string, Entry> entries;
+		float ttlSeconds = 30.0f;
+		float failedTtlSeconds = 1.0f;
+
+		static void HelperResolveThread(AddressCache *cache, std::string host)
+		{
+			std::vector<sockaddr_storage> addresses;
+			addrinfo hints;
+			std::memset(&hints, 0, sizeof(hints));
+			hints.ai_family = AF_UNSPEC;
+			hints.ai_socktype = SOCK_STREAM;
+			hints.ai_flags = AI_ADDRCONFIG;
+			addrinfo *found = nullptr;
+			if(getaddrinfo(host.c_str(), nullptr, &hints, &found) == 0)
+			{
+				for(addrinfo *info = found; info; info = info->ai_next)
+				{
+					if(info->ai_family != AF_INET && info->ai_family != AF_INET6)
+						continue;
+					sockaddr_storage address;
+					std::memset(&address, 0, sizeof(address));
+					std::memcpy(&address, info->ai_addr, info->ai_addrlen);
+					addresses.push_back(address);
+				}
+				freeaddrinfo(found);
+			}
+
+			std::lock_guard<std::mutex> guard(cache->lock);
+			Entry &entry = cache->entries[host];
+			float keepSeconds = addresses.empty() ? cache->failedTtlSeconds : cache->ttlSeconds;
+			entry.addresses = std::move(addresses);
+			entry.expireTime = std::chrono::steady_clock::now() + 
+				std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(keepSeconds));
+			entry.resolved = true;
+			entry.resolving = false;
+			cache->resolvedSignal.notify_all();
 		}
 
-		// Try to open connection to remote listener. This should block until the connection returns good or not.
-		// address, port : location to try to connect to
-		// return : true if successfully connected, false if not
-		virtual bool Connect(std::string const &address, uint16_t port) override
+		// call with lock held
+		void HelperStartResolve(std::string const &host, Entry &entry)
 		{
-			sockaddr_in target;
-			std::memset(&target, 0, sizeof(target));
-			target.sin_family = AF_INET;
-			target.sin_addr.s_addr = inet_addr(address.c_str());
-			target.sin_port = htons(port);
-			
-			if(connect(mySocket, reinterpret_cast<sockaddr*>(&target), sizeof(target)) < 0)
-				return false;
-			return true;
+			if(entry.resolving)
+				return;
+			entry.resolving = true;
+			std::thread(HelperResolveThread, this, host).detach();
 		}
 
-		// Set the connection to start listening.
-		// acceptQueueSize : requested size of the accept queue
-		// return : true if successfully listening, false if not
-		virtual bool Listen(uint16_t acceptQueueSize) override
+		// call with lock held
+		void HelperTrim(void)
 		{
-			if(listen(mySocket, acceptQueueSize) == 0)
+			auto now = std::chrono::steady_clock::now();
+			for(auto it = entries.begin(); it != entries.end();)
 			{
-				// make listener non-blocking
-				int flags = fcntl(mySocket, F_GETFL);
-				fcntl(mySocket, F_SETFL, flags | O_NONBLOCK);
-				return true;
+				if(!it->second.resolving && it->second.expireTime < now)
+					it = entries.erase(it);
+				else
+					++it;
 			}
-			return false;
+		}
+	public:
+		// the lookup threads can outlive everything else, so the cache is never destroyed
+		static AddressCache &Get(void)
+		{
+			static AddressCache *cache = new AddressCache();
+			return *cache;
 		}
 
-		// Try to accept a new connection from a listening port. This function should not block.
-		// return : true if listening port is still good
-		// newConnection : return the new connection, or nullptr if there was no new connection
-		virtual bool Accept(std::unique_ptr<ConnectionBase> &newConnection) override
+		void SetTtl(float ttl)
 		{
-			sockaddr_in newAddr;
-			std::memset(&newAddr, 0, sizeof(newAddr));
-			socklen_t addrLen = sizeof(newAddr);
-			int newSocket = accept(mySocket, reinterpret_cast<sockaddr*>(&newAddr), &addrLen);
-			if(newSocket == EAGAIN || newSocket == EWOULDBLOCK)
+			std::lock_guard<std::mutex> guard(lock);
+			ttlSeconds = ttl;
+		}
+
+		// Gets the addresses for a host name, waiting for the lookup only if there is nothing usable yet.
+		// timeoutSeconds : the maximum amount of time to wait for a lookup, negative to wait until it's done
+		// return : true if there are addresses
+		// outTimedOut : true if the lookup didn't finish in time
+		bool Find(std::string const &host, float timeoutSeconds, std::vector<sockaddr_storage> &outAddresses, bool &outTimedOut)
+		{
+			outTimedOut = false;
+			auto now = std::chrono::steady_clock::now();
+			std::unique_lock<std::mutex> guard(lock);
+			if(entries.size() >= maxEntries && entries.find(host) == entries.end())
+				HelperTrim();
+			Entry &entry = entries[host];
+
+			// stale addresses are good enough while the refresh runs
+			if(entry.resolved && !entry.addresses.empty())
+			{
+				if(entry.expireTime < now)
+					HelperStartResolve(host, entry);
+				outAddresses = entry.addresses;
 				return true;
-			else if(newSocket < -1)
+			}
+			if(entry.resolved && entry.expireTime >= now)
 				return false;
-			else
+
+			// nothing usable, wait for the lookup. Entries are only erased when they aren't resolving, but once the
+			//    lookup is done another Find can trim it before this one wakes, so the host is looked up again
+			HelperStartResolve(host, entry);
+			auto done = [&]
 			{
-				newConnection.reset(new DefaultConnection(newSocket));
-				return true;
+				auto found = entries.find(host);
+				return found == entries.end() || !found->second.resolving;
+			};
+			if(timeoutSeconds < 0.0f)
+				resolvedSignal.wait(guard, done);
+			else if(!resolvedSignal.wait_for(guard, std::chrono::duration<float>(timeoutSeconds), done))
+			{
+				outTimedOut = true;
+				return false;
 			}
+			auto found = entries.find(host);
+			if(found == entries.end())
+				return false;
+			outAddresses = found->second.addresses;
+			return !outAddresses.empty();
 		}
+	};
 
-		// Sends the data, send all the data. The send is responsible for sending a way for receive to know when
-		//    all of the data has been read.
-		// inBuffer : buffer that has all the data to send
-		// sizeBytes : size in bytes of the buffer
-		// return : true if successfully sent, false if not
-		virtual bool Send(std::unique_ptr<char[]> const &inBuffer, uint16_t sizeBytes) override
-		{
-			std::unique_ptr<char[]> tempBuff(new char[sizeBytes + sizeof(uint16_t)]);
-			if(!tempBuff)
-				return false;
+	// Fills in the address of a unix socket.
+	// return : false if the path doesn't fit
+	bool MakeLocalAddress(std::string const &path, sockaddr_storage &outAddress)
+	{
+		std::memset(&outAddress, 0, sizeof(outAddress));
+		sockaddr_un &local = reinterpret_cast<sockaddr_un&>(outAddress);
+		if(path.empty() || path.size() >= sizeof(local.sun_path))
+			return false;
+		local.sun_family = AF_UNIX;
+		std::memcpy(local.sun_path, path.c_str(), path.size());
+		return true;
+	}
 
-			*reinterpret_cast<uint16_t*>(tempBuff.get()) = htons(sizeBytes);
-			std::memcpy(tempBuff.get() + sizeof(uint16_t), inBuffer.get(), sizeBytes);
+	// Reads an IPv4 or IPv6 address, IPv6 may be in brackets, or the path of a unix socket after "unix:".
+	// return : true if address was a numeric address
+	bool ParseNumericAddress(std::string const &address, sockaddr_storage &outAddress)
+	{
+		if(address.compare(0, 5, "unix:") == 0)
+			return MakeLocalAddress(address.substr(5), outAddress);
 
-			if(write(mySocket, tempBuff.get(), sizeBytes + sizeof(uint16_t)) != int32_t(sizeBytes + sizeof(uint16_t)))
-				return false;
+		std::memset(&outAddress, 0, sizeof(outAddress));
+		sockaddr_in &address4 = reinterpret_cast<sockaddr_in&>(outAddress);
+		if(inet_pton(AF_INET, address.c_str(), &address4.sin_addr) == 1)
+		{
+			address4.sin_family = AF_INET;
 			return true;
 		}
 
-		// Try to receive SizeBytes of data. This should be non-blocking until data starts coming in, then it
-		//    should block until all the data is read.
-		// return : true if the connection is still in a good state, false if not
-		// outBuffer : the buffer with the read data in it, or nullptr if there was no data ready to read
-		// outSizeBytes : size of the buffer returned
-		virtual bool Recv(std::unique_ptr<char[]> &outBuffer, uint16_t &outSizeBytes) override
+		std::string inner = address;
+		if(inner.size() > 2 && inner.front() == '[' && inner.back() == ']')
+			inner = inner.substr(1, inner.size() - 2);
+		sockaddr_in6 &address6 = reinterpret_cast<sockaddr_in6&>(outAddress);
+		if(inet_pton(AF_INET6, inner.c_str(), &address6.sin6_addr) == 1)
 		{
-			outBuffer.reset();
-			outSizeBytes = 0;
+			address6.sin6_family = AF_INET6;
+			return true;
+		}
+		return false;
+	}
 
-			pollfd dataCheck;
-			dataCheck.fd = mySocket;
-			dataCheck.events = POLLIN;
-			dataCheck.revents = 0;
-			if(poll(&dataCheck, 1, 1) < 0)
-				return false;
-			if(dataCheck.revents != POLLIN)
-				return true;
-			
+	class DefaultConnection : public netfunc::SpanConnectionBase
+	{
+		int mySocket = -1;
+		int family = AF_INET;
+		netfunc::SocketOptions options;
+
+		// a listening connection with a path listens on a unix socket there instead of a port
+		std::string localPath;
+
+		// a message RecvAvailable has only part of. Its size is kept in the connection and the buffer for the
+		//    rest is only taken once the size is known, so a connection that is waiting for its first bytes holds none
+		char partialSize[sizeof(uint16_t)];
+		std::unique_ptr<char[]> partial;
+		uint32_t partialBytes = 0;
+		uint32_t partialCapacity = 0;
+
+		// The kernel drops back to delayed acks on its own, so quick ack has to be asked for again.
+		void HelperQuickAck(void)
+		{
+#if defined(TCP_QUICKACK)
+			if(options.quickAck)
 			{
-				uint16_t tempSize;
-				int thisRead = read(mySocket, reinterpret_cast<char*>(&tempSize), sizeof(uint16_t));
-				if(thisRead != sizeof(uint16_t))
-					return false;
-				outSizeBytes = ntohs(tempSize);
+				int on = 1;
+				setsockopt(mySocket, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
 			}
+#endif
+		}
 
-			int32_t readBytes = 0;
-			outBuffer.reset(new char[outSizeBytes]);
-			if(!outBuffer)
-				return false;
-			while(readBytes < outSizeBytes)
+		// Applies the options that belong to a connected socket. They are only hints, failures are ignored.
+		void HelperApplyOptions(int socketToSet)
+		{
+			int on = 1;
+			if(options.noDelay)
+				setsockopt(socketToSet, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#if defined(TCP_QUICKACK)
+			if(options.quickAck)
+				setsockopt(socketToSet, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+#endif
+#if defined(SO_BUSY_POLL)
+			if(options.busyPollMicroseconds > 0)
+				setsockopt(socketToSet, SOL_SOCKET, SO_BUSY_POLL, &options.busyPollMicroseconds, sizeof(int));
+#endif
+			if(options.keepAliveIdleSeconds > 0)
 			{
-				int thisRead = read(mySocket, outBuffer.get()+readBytes, outSizeBytes - readBytes);
-				if(thisRead < 0)
-					return false;
-				readBytes += thisRead;
+				setsockopt(socketToSet, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+#if defined(TCP_KEEPIDLE)
+				setsockopt(socketToSet, IPPROTO_TCP, TCP_KEEPIDLE, &options.keepAliveIdleSeconds, sizeof(int));
+#endif
+#if defined(TCP_KEEPINTVL)
+				if(options.keepAliveIntervalSeconds > 0)
+					setsockopt(socketToSet, IPPROTO_TCP, TCP_KEEPINTVL, &options.keepAliveIntervalSeconds, sizeof(int));
+#endif
+#if defined(TCP_KEEPCNT)
+				if(options.keepAliveCount > 0)
+					setsockopt(socketToSet, IPPROTO_TCP, TCP_KEEPCNT, &options.keepAliveCount, sizeof(int));
+#endif
 			}
-			return true;
-		}
-	};
-}
+#if defined(TCP_USER_TIMEOUT)
+			if(options.userTimeoutMs > 0)
+				setsockopt(socketToSet, IPPROTO_TCP, TCP_USER_TIMEOUT, &options.userTimeoutMs, sizeof(int));
 #endif
+			// buffer sizes have to be set before connect or listen to affect the window
+			if(options.sendBufferBytes > 0)
+				setsockopt(socketToSet, SOL_SOCKET, SO_SNDBUF, &options.sendBufferBytes, sizeof(int));
+			if(options.recvBufferBytes > 0)
+				setsockopt(socketToSet, SOL_SOCKET, SO_RCVBUF, &options.recvBufferBytes, sizeof(int));
+		}
 
+		// Makes a socket of the family, closing the one there was.
+		bool HelperSocket(int newFamily)
+		{
+			if(mySocket >= 0)
+				close(mySocket);
+			mySocket = socket(newFamily, SOCK_STREAM, 0);
+			family = newFamily;
+			if(mySocket < 0)
+				return false;
+			HelperApplyOptions(mySocket);
+			return true;
+		}
 
-// netfunc Listener definitions
+		// Connects to one address, waiting on the non-blocking connect with poll.
+		netfunc::ErrorResult HelperConnect(sockaddr_storage const &address, float timeoutSeconds)
+		{
+			// IPv4 addresses go through a dual stack socket as mapped IPv6 addresses
+			sockaddr_storage target = address;
+			socklen_t targetLen = address.ss_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+			if(address.ss_family == AF_UNIX)
+				targetLen = sizeof(sockaddr_un);
+			if(family == AF_INET6 && address.ss_family == AF_INET)
+			{
+				sockaddr_in const &address4 = reinterpret_cast<sockaddr_in const&>(address);
+				sockaddr_in6 &mapped = reinterpret_cast<sockaddr_in6&>(target);
+				std::memset(&target, 0, sizeof(target));
+				mapped.sin6_family = AF_INET6;
+				mapped.sin6_port = address4.sin_port;
+				mapped.sin6_addr.s6_addr[10] = 0xff;
+				mapped.sin6_addr.s6_addr[11] = 0xff;
+				std::memcpy(&mapped.sin6_addr.s6_addr[12], &address4.sin_addr, sizeof(address4.sin_addr));
+				targetLen = sizeof(sockaddr_in6);
+			}
+			else if(family != address.ss_family && !HelperSocket(address.ss_family))
+				return netfunc::ErrorResult::Net_Error;
+
+			int flags = fcntl(mySocket, F_GETFL);
+			if(flags < 0 || fcntl(mySocket, F_SETFL, flags | O_NONBLOCK) < 0)
+				return netfunc::ErrorResult::Net_Error;
+
+			int connectError = 0;
+			if(connect(mySocket, reinterpret_cast<sockaddr*>(&target), targetLen) < 0)
+				connectError = errno;
+			if(connectError == EINPROGRESS)
+			{
+				auto deadline = std::chrono::steady_clock::now() +
+					std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(timeoutSeconds));
+				for(;;)
+				{
+					int waitMs = -1;
+					if(timeoutSeconds >= 0.0f)
+					{
+						auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+						waitMs = int(std::max<int64_t>(left.count(), 0));
+					}
+
+					pollfd connectCheck;
+					connectCheck.fd = mySocket;
+					connectCheck.events = POLLOUT;
+					connectCheck.revents = 0;
+					int ready = poll(&connectCheck, 1, waitMs);
+					if(ready < 0 && errno == EINTR)
+						continue;
+					if(ready < 0)
+						return netfunc::ErrorResult::Net_Error;
+					if(ready == 0)
+						return netfunc::ErrorResult::Connect_Timeout;
+
+					socklen_t errorLen = sizeof(connectError);
+					if(getsockopt(mySocket, SOL_SOCKET, SO_ERROR, &connectError, &errorLen) < 0)
+						return netfunc::ErrorResult::Net_Error;
+					break;
+				}
+			}
+
+			switch(connectError)
+			{
+			case 0:
+				break;
+			case ECONNREFUSED:
+			case ENOENT:
+				return netfunc::ErrorResult::Invalid_Address;
+			case ETIMEDOUT:
+				return netfunc::ErrorResult::Connect_Timeout;
+			default:
+				return netfunc::ErrorResult::Net_Error;
+			}
+
+			// the rest of the connection expects blocking sends and reads
+			if(fcntl(mySocket, F_SETFL, flags) < 0)
+				return netfunc::ErrorResult::Net_Error;
+			return netfunc::ErrorResult::Call_Ok;
+		}
+	public:
+		DefaultConnection() = default;
+		DefaultConnection(int in) : mySocket(in) {}
+		DefaultConnection(std::string const &path) : localPath(path) {}
+		~DefaultConnection()
+		{
+			if(partial)
+				netfunc::BufferPool::Release(partial, partialCapacity);
+		}
+
+		// Sets up the port and gets it ready to either connect or listen.
+		// port : the port to try to setup
+		// return : true if setup was successful, false if not
+		virtual bool Setup(uint16_t port) override
+		{
+			if(!localPath.empty())
+			{
+				sockaddr_storage local;
+				if(!MakeLocalAddress(localPath, local))
+					return false;
+				mySocket = socket(AF_UNIX, SOCK_STREAM, 0);
+				family = AF_UNIX;
+				if(mySocket < 0)
+					return false;
+				unlink(localPath.c_str());
+				if(bind(mySocket, reinterpret_cast<sockaddr*>(&local), sizeof(sockaddr_un)) < 0)
+				{
+					close(mySocket);
+					mySocket = -1;
+					return false;
+				}
+				return true;
+			}
+
+			// prefer a dual stack socket so both IPv4 and IPv6 work, unless the system has no IPv6
+			mySocket = socket(AF_INET6, SOCK_STREAM, 0);
+			if(mySocket >= 0)
+			{
+				HelperApplyOptions(mySocket);
+				int v6Only = 0;
+				setsockopt(mySocket, IPPROTO_IPV6, IPV6_V6ONLY, &v6Only, sizeof(v6Only));
+				sockaddr_in6 sockAddr6;
+				std::memset(&sockAddr6, 0, sizeof(sockAddr6));
+				sockAddr6.sin6_family = AF_INET6;
+				sockAddr6.sin6_addr = in6addr_any;
+				sockAddr6.sin6_port = htons(port);
+				if(bind(mySocket, reinterpret_cast<sockaddr*>(&sockAddr6), sizeof(sockAddr6)) == 0)
+				{
+					family = AF_INET6;
+					return true;
+				}
+				int bindError = errno;
+				close(mySocket);
+				mySocket = -1;
+				if(bindError == EADDRINUSE)
+					return false;
+			}
+
+			family = AF_INET;
+			mySocket = socket(AF_INET, SOCK_STREAM, 0);
+			if(mySocket < 0)
+				return false;
+			HelperApplyOptions(mySocket);
+			sockaddr_in sockAddr;
+			std::memset(&sockAddr, 0, sizeof(sockAddr));
+			sockAddr.sin_family = AF_INET;
+			sockAddr.sin_addr.s_addr = INADDR_ANY;
+			sockAddr.sin_port = htons(port);
+			if(bind(mySocket, reinterpret_cast<sockaddr*>(&sockAddr), sizeof(sockAddr)) < 0)
+			{
+				close(mySocket);
+				mySocket = -1;
+				return false;
+			}
+			return true;
+		}
+
+		// Destroys the open connection.
+		virtual void Stop(void) override
+		{
+			close(mySocket);
+		}
+
+		// Sets the socket options used from the next Setup on, accepted connections get them too.
+		virtual void SetOptions(netfunc::SocketOptions const &newOptions) override
+		{
+			options = newOptions;
+		}
+
+		// Try to open connection to remote listener. This should block until the connection returns good or not.
+		// address, port : location to try to connect to
+		// return : true if successfully connected, false if not
+		virtual bool Connect(std::string const &address, uint16_t port) override
+		{
+			return ConnectWithin(address, port, -1.0f) == netfunc::ErrorResult::Call_Ok;
+		}
+
+		// Try to open connection to remote listener, giving up once timeoutSeconds have passed. Host names are
+		//    looked up through the address cache and each address is tried in turn. The connects are started
+		//    non-blocking and waited on with poll, so a dead address can't hold the caller for the kernel's
+		//    retry time.
+		// address, port : location to try to connect to, a host name or an IPv4 or IPv6 address, or "unix:"
+		//    and the path of a unix socket, where the port isn't used
+		// timeoutSeconds : the maximum amount of time to wait, negative to wait as long as the kernel does
+		// return : Call_Ok if connected, Invalid_Address if nothing is listening there, Connect_Timeout if the
+		//    time ran out, Net_Error for anything else
+		virtual netfunc::ErrorResult ConnectWithin(std::string const &address, uint16_t port, float timeoutSeconds) override
+		{
+			auto start = std::chrono::steady_clock::now();
+			std::vector<sockaddr_storage> addresses(1);
+			if(!ParseNumericAddress(address, addresses[0]))
+			{
+				bool timedOut = false;
+				if(!AddressCache::Get().Find(address, timeoutSeconds, addresses, timedOut))
+					return timedOut ? netfunc::ErrorResult::Connect_Timeout : netfunc::ErrorResult::Invalid_Address;
+			}
+
+			// try the addresses in order until one answers, each gets what is left of the time
+			netfunc::ErrorResult connected = netfunc::ErrorResult::Net_Error;
+			for(size_t i = 0; i < addresses.size(); ++i)
+			{
+				if(addresses[i].ss_family == AF_INET)
+					reinterpret_cast<sockaddr_in&>(addresses[i]).sin_port = htons(port);
+				else if(addresses[i].ss_family == AF_INET6)
+					reinterpret_cast<sockaddr_in6&>(addresses[i]).sin6_port = htons(port);
+
+				// a socket that failed to connect can't be used again
+				if(i != 0 && !HelperSocket(family))
+					return netfunc::ErrorResult::Net_Error;
+
+				float timeLeft = timeoutSeconds;
+				if(timeoutSeconds >= 0.0f)
+				{
+					timeLeft -= std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+					if(timeLeft <= 0.0f)
+						return netfunc::ErrorResult::Connect_Timeout;
+				}
+				connected = HelperConnect(addresses[i], timeLeft);
+				if(connected == netfunc::ErrorResult::Call_Ok || connected == netfunc::ErrorResult::Connect_Timeout)
+					return connected;
+			}
+			return connected;
+		}
+
+		// Set the connection to start listening.
+		// acceptQueueSize : requested size of the accept queue
+		// return : true if successfully listening, false if not
+		virtual bool Listen(uint16_t acceptQueueSize) override
+		{
+			if(listen(mySocket, acceptQueueSize) == 0)
+			{
+#if defined(TCP_DEFER_ACCEPT)
+				if(options.deferAcceptSeconds > 0)
+					setsockopt(mySocket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &options.deferAcceptSeconds, sizeof(int));
+#endif
+				// make listener non-blocking
+				int flags = fcntl(mySocket, F_GETFL);
+				fcntl(mySocket, F_SETFL, flags | O_NONBLOCK);
+				return true;
+			}
+			return false;
+		}
+
+		// Takes over a socket that is already bound and listening, handed over by another process.
+		// fd : the listening socket, the connection owns it from then on
+		// return : true if the connection took it
+		virtual bool AdoptListening(int fd) override
+		{
+			sockaddr_storage address;
+			socklen_t addressLen = sizeof(address);
+			if(getsockname(fd, reinterpret_cast<sockaddr*>(&address), &addressLen) < 0)
+				return false;
+			int flags = fcntl(fd, F_GETFL);
+			if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+				return false;
+			if(mySocket >= 0)
+				close(mySocket);
+			mySocket = fd;
+			family = address.ss_family;
+			return true;
+		}
+
+		// Try to accept a new connection from a listening port. This function should not block.
+		// return : true if listening port is still good
+		// newConnection : return the new connection, or nullptr if there was no new connection
+		virtual bool Accept(std::unique_ptr<ConnectionBase> &newConnection) override
+		{
+			sockaddr_storage newAddr;
+			std::memset(&newAddr, 0, sizeof(newAddr));
+			socklen_t addrLen = sizeof(newAddr);
+			int newSocket = accept(mySocket, reinterpret_cast<sockaddr*>(&newAddr), &addrLen);
+			if(newSocket < 0)
+			{
+				// accept reports failures through errno, a connection that was reset while queued isn't fatal
+				return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED;
+			}
+
+			DefaultConnection *accepted = new DefaultConnection(newSocket);
+			newConnection.reset(accepted);
+			accepted->options = options;
+			accepted->HelperApplyOptions(newSocket);
+			return true;
+		}
+
+		// Sends the parts as one message, the size goes first so receive knows when all of the data has been read.
+		// parts : the memory to send, in order
+		// partCount : number of parts
+		// return : true if successfully sent, false if not
+		virtual bool SendParts(netfunc::SendSpan const *parts, uint32_t partCount) override
+		{
+			// send the size and the parts together without copying them into one buffer
+			const uint32_t maxParts = 16;
+			if(partCount >= maxParts)
+				return ConnectionBase::SendParts(parts, partCount);
+
+			size_t sizeBytes = 0;
+			iovec vectors[maxParts];
+			for(uint32_t i = 0; i < partCount; ++i)
+			{
+				vectors[i + 1].iov_base = const_cast<char*>(parts[i].data);
+				vectors[i + 1].iov_len = parts[i].sizeBytes;
+				sizeBytes += parts[i].sizeBytes;
+			}
+			if(sizeBytes > netfunc::maxMessageBytes)
+				return false;
+
+			uint16_t tempSize = htons(uint16_t(sizeBytes));
+			vectors[0].iov_base = &tempSize;
+			vectors[0].iov_len = sizeof(uint16_t);
+
+			// a requester that went away should fail the send, not raise SIGPIPE
+			msghdr message;
+			std::memset(&message, 0, sizeof(message));
+			message.msg_iov = vectors;
+			message.msg_iovlen = partCount + 1;
+#if defined(MSG_NOSIGNAL)
+			const int sendFlags = MSG_NOSIGNAL;
+#else
+			const int sendFlags = 0;
+#endif
+			if(sendmsg(mySocket, &message, sendFlags) != ssize_t(sizeBytes + sizeof(uint16_t)))
+				return false;
+			return true;
+		}
+
+		// Try to receive a message into a buffer owned by the caller. This is non-blocking until data starts
+		//    coming in, then it blocks until all the data is read.
+		// buffer, capacityBytes : where to put the message, a message that doesn't fit is an error
+		// return : true if the connection is still in a good state, false if not
+		// outSizeBytes : size of the message received
+		// outReceived : false if there was no data ready to read
+		virtual bool RecvInto(char *buffer, uint32_t capacityBytes, uint16_t &outSizeBytes, bool &outReceived) override
+		{
+			outSizeBytes = 0;
+			outReceived = false;
+
+			pollfd dataCheck;
+			dataCheck.fd = mySocket;
+			dataCheck.events = POLLIN;
+			dataCheck.revents = 0;
+			if(poll(&dataCheck, 1, 1) < 0)
+				return false;
+			if(dataCheck.revents == 0)
+				return true;
+			// a closed or broken socket stays readable, what is left of it is read and then read fails
+			if(!(dataCheck.revents & POLLIN))
+				return false;
+
+			uint16_t sizeBytes;
+			{
+				uint16_t tempSize;
+				int thisRead = read(mySocket, reinterpret_cast<char*>(&tempSize), sizeof(uint16_t));
+				if(thisRead != sizeof(uint16_t))
+					return false;
+				sizeBytes = ntohs(tempSize);
+			}
+			if(sizeBytes > capacityBytes)
+				return false;
+
+			int32_t readBytes = 0;
+			while(readBytes < sizeBytes)
+			{
+				int thisRead = read(mySocket, buffer+readBytes, sizeBytes - readBytes);
+				if(thisRead <= 0)
+					return false;
+				readBytes += thisRead;
+			}
+			outSizeBytes = sizeBytes;
+			outReceived = true;
+			HelperQuickAck();
+			return true;
+		}
+
+		// Try to receive a message without blocking at all. Whatever has arrived is read into a buffer the
+		//    connection keeps until the whole message is there.
+		// buffer, capacityBytes : where to put the message, a message that doesn't fit is an error
+		// return : true if the connection is still in a good state, false if not
+		// outSizeBytes : size of the message received
+		// outReceived : false if there was no whole message ready to read
+		virtual bool RecvAvailable(char *buffer, uint32_t capacityBytes, uint16_t &outSizeBytes, bool &outReceived) override
+		{
+			outSizeBytes = 0;
+			outReceived = false;
+
+			// gather the size first, then the message it tells the size of
+			for(;;)
+			{
+				uint32_t wantedBytes = sizeof(uint16_t);
+				if(partialBytes >= sizeof(uint16_t))
+				{
+					uint16_t tempSize;
+					std::memcpy(&tempSize, partialSize, sizeof(uint16_t));
+					wantedBytes += ntohs(tempSize);
+					if(wantedBytes - sizeof(uint16_t) > capacityBytes)
+						return false;
+				}
+				if(partialBytes == wantedBytes)
+					break;
+
+				char *target = partialSize + partialBytes;
+				if(partialBytes >= sizeof(uint16_t))
+				{
+					if(!partial)
+					{
+						partialCapacity = wantedBytes - sizeof(uint16_t);
+						partial = netfunc::BufferPool::Acquire(partialCapacity);
+					}
+					target = partial.get() + partialBytes - sizeof(uint16_t);
+				}
+				ssize_t thisRead = recv(mySocket, target, wantedBytes - partialBytes, MSG_DONTWAIT);
+				if(thisRead == 0)
+					return false;
+				if(thisRead < 0)
+					return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+				partialBytes += uint32_t(thisRead);
+			}
+
+			outSizeBytes = uint16_t(partialBytes - sizeof(uint16_t));
+			if(partial)
+			{
+				std::memcpy(buffer, partial.get(), outSizeBytes);
+				netfunc::BufferPool::Release(partial, partialCapacity);
+			}
+			partialBytes = 0;
+			outReceived = true;
+			HelperQuickAck();
+			return true;
+		}
+
+		// Gets the memory the connection holds, itself and the buffer of a message that has partly arrived.
+		virtual size_t HeldBytes(void) const override
+		{
+			return sizeof(*this) + (partial ? partialCapacity : 0);
+		}
+
+		// Gets the socket, it polls readable when there is data to receive or a connection to accept.
+		// return : the descriptor, or -1
+		virtual int PollHandle(void) const override
+		{
+			return mySocket;
+		}
+
+		// Sends a range of a file as messages of at most maxMessageBytes. Only the sizes pass through user space,
+		//    the file data goes from the page cache to the socket with sendfile.
+		// fd, offset, sizeBytes : the range to send, the file position of fd is not used
+		// return : true if the whole range was sent, false if not
+		virtual bool SendFile(int fd, uint64_t offset, uint64_t sizeBytes) override
+		{
+#if defined(__linux__)
+			NoSigPipeScope noSigPipe;
+			off_t fileOffset = off_t(offset);
+			while(sizeBytes > 0)
+			{
+				uint16_t pieceBytes = uint16_t(std::min<uint64_t>(sizeBytes, netfunc::maxMessageBytes));
+				uint16_t tempSize = htons(pieceBytes);
+				if(send(mySocket, &tempSize, sizeof(uint16_t), MSG_MORE | MSG_NOSIGNAL) != ssize_t(sizeof(uint16_t)))
+					return false;
+
+				uint32_t sentBytes = 0;
+				while(sentBytes < pieceBytes)
+				{
+					// 0 means the file is shorter than the range
+					ssize_t thisSend = sendfile(mySocket, fd, &fileOffset, pieceBytes - sentBytes);
+					if(thisSend <= 0)
+						return false;
+					sentBytes += uint32_t(thisSend);
+				}
+				sizeBytes -= pieceBytes;
+			}
+			return true;
+#else
+			return ConnectionBase::SendFile(fd, offset, sizeBytes);
+#endif
+		}
+	};
+}
+#endif
+
+// file helpers, the file functions only do something where files are file descriptors
 namespace netfunc
 {
-	// Starts the listener port and sets up the backend to start accepting and handling requests.
-	// port : the port to setup and listen on
-	// helperNum : maximum number of helper threads
-	//    if this is 0, no threads will be created and all work will be done on the calls to Update
-	//    if otherwise, a thread will be created for accepting and processing requests as needed
-	// acceptQueueSize : size of the accept queue passed into Listen
-	// timeoutSeconds : the maximum amount of time a connection should wait for data from the requester
-	//    only used if helperNum is not 0
-	ErrorResult Listener::Start(uint16_t port, uint16_t helperNum, uint16_t acceptQueueSize, float timeoutSeconds)
+	// Sends a range of a file as messages of at most maxMessageBytes, each received the same way as one sent
+	//    with Send. By default each piece is read into a buffer and passed to SendParts.
+	bool ConnectionBase::SendFile(int fd, uint64_t offset, uint64_t sizeBytes)
+	{
+#if defined(__GNUC__)
+		std::unique_ptr<char[]> buffer = BufferPool::Acquire(maxMessageBytes);
+		bool sent = true;
+		while(sent && sizeBytes > 0)
+		{
+			size_t pieceBytes = size_t(std::min<uint64_t>(sizeBytes, maxMessageBytes));
+			size_t readBytes = 0;
+			while(sent && readBytes < pieceBytes)
+			{
+				ssize_t thisRead = pread(fd, buffer.get() + readBytes, pieceBytes - readBytes, off_t(offset + readBytes));
+				sent = thisRead > 0;
+				if(sent)
+					readBytes += size_t(thisRead);
+			}
+			if(!sent)
+				break;
+			SendSpan part = { buffer.get(), pieceBytes };
+			sent = SendParts(&part, 1);
+			offset += pieceBytes;
+			sizeBytes -= pieceBytes;
+		}
+		BufferPool::Release(buffer, maxMessageBytes);
+		return sent;
+#else
+		return sizeBytes == 0;
+#endif
+	}
+}
+
+namespace
+{
+	// Closes the file of a FileRange that asked for it when the call is over, however it ends.
+	class FileRangeCloser
+	{
+		netfunc::FileRange &file;
+	public:
+		FileRangeCloser(netfunc::FileRange &fileIn) : file(fileIn) {}
+		~FileRangeCloser()
+		{
+#if defined(__GNUC__)
+			if(file.closeWhenSent && file.fd >= 0)
+				close(file.fd);
+#endif
+		}
+		FileRangeCloser(FileRangeCloser&) = delete;
+		void operator=(FileRangeCloser&) = delete;
+	};
+}
+
+// hand off helpers, the listening sockets are passed between processes over a unix socket with SCM_RIGHTS.
+//    The new listener sends the port it wants and gets the sockets back with one byte of data.
+namespace
+{
+	// Starts serving hand offs on a unix socket, replacing whatever was at the path.
+	// return : the non-blocking unix socket, or -1
+	int HandOffServe(std::string const &path)
+	{
+#if defined(__GNUC__)
+		sockaddr_un address;
+		std::memset(&address, 0, sizeof(address));
+		if(path.size() >= sizeof(address.sun_path))
+			return -1;
+		address.sun_family = AF_UNIX;
+		std::memcpy(address.sun_path, path.c_str(), path.size());
+
+		int serveSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(serveSocket < 0)
+			return -1;
+		unlink(path.c_str());
+		int flags = fcntl(serveSocket, F_GETFL);
+		if(bind(serveSocket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(serveSocket, 4) < 0 ||
+			flags < 0 || fcntl(serveSocket, F_SETFL, flags | O_NONBLOCK) < 0)
+		{
+			close(serveSocket);
+			return -1;
+		}
+		return serveSocket;
+#else
+		return -1;
+#endif
+	}
+
+	// Stops serving hand offs.
+	// removePath : take the path away too, not done once a new listener has made its own socket there
+	void HandOffClose(int serveSocket, std::string const &path, bool removePath)
+	{
+#if defined(__GNUC__)
+		if(serveSocket >= 0)
+			close(serveSocket);
+		if(removePath && !path.empty())
+			unlink(path.c_str());
+#endif
+	}
+
+	// Waits up to timeoutSeconds for a socket to be readable.
+	bool HandOffWait(int unixSocket, float timeoutSeconds)
+	{
+#if defined(__GNUC__)
+		pollfd dataCheck;
+		dataCheck.fd = unixSocket;
+		dataCheck.events = POLLIN;
+		dataCheck.revents = 0;
+		return poll(&dataCheck, 1, int(timeoutSeconds * 1000.0f)) == 1;
+#else
+		return false;
+#endif
+	}
+
+	const size_t maxHandOffSockets = 64;
+
+	// Answers a listener asking for the listening sockets, if one is waiting. It has to ask for the same port.
+	// port : the port passed to Start
+	// listeningFds : the sockets being listened on, the one on port first
+	// timeoutSeconds : how long the asking listener gets to say which port it wants
+	// return : true if the sockets were handed off
+	bool HandOffAnswer(int serveSocket, uint16_t port, std::vector<int> const &listeningFds, float timeoutSeconds)
+	{
+#if defined(__GNUC__)
+		int askSocket = accept(serveSocket, nullptr, nullptr);
+		if(askSocket < 0)
+			return false;
+
+		uint16_t wantedPort = 0;
+		bool sent = false;
+		size_t fdBytes = listeningFds.size() * sizeof(int);
+		if(!listeningFds.empty() && listeningFds.size() <= maxHandOffSockets && HandOffWait(askSocket, timeoutSeconds) &&
+			recv(askSocket, &wantedPort, sizeof(wantedPort), MSG_WAITALL) == sizeof(wantedPort) && ntohs(wantedPort) == port)
+		{
+			char data = 1;
+			iovec vector;
+			vector.iov_base = &data;
+			vector.iov_len = 1;
+			std::vector<cmsghdr> control((CMSG_SPACE(fdBytes) + sizeof(cmsghdr) - 1) / sizeof(cmsghdr));
+
+			msghdr message;
+			std::memset(&message, 0, sizeof(message));
+			message.msg_iov = &vector;
+			message.msg_iovlen = 1;
+			message.msg_control = control.data();
+			message.msg_controllen = CMSG_SPACE(fdBytes);
+			cmsghdr *header = CMSG_FIRSTHDR(&message);
+			header->cmsg_level = SOL_SOCKET;
+			header->cmsg_type = SCM_RIGHTS;
+			header->cmsg_len = CMSG_LEN(fdBytes);
+			std::memcpy(CMSG_DATA(header), listeningFds.data(), fdBytes);
+#if defined(MSG_NOSIGNAL)
+			const int sendFlags = MSG_NOSIGNAL;
+#else
+			const int sendFlags = 0;
+#endif
+			sent = sendmsg(askSocket, &message, sendFlags) == 1;
+		}
+		close(askSocket);
+		return sent;
+#else
+		return false;
+#endif
+	}
+
+	// Asks the listener serving the path for its listening sockets.
+	// port : the port passed to Start, the first socket has to be listening on it
+	// timeoutSeconds : how long to wait for the answer
+	// return : the listening sockets, empty if nobody handed any over
+	std::vector<int> HandOffReceive(std::string const &path, uint16_t port, float timeoutSeconds)
+	{
+		std::vector<int> listeningFds;
+#if defined(__GNUC__)
+		sockaddr_un address;
+		std::memset(&address, 0, sizeof(address));
+		if(path.size() >= sizeof(address.sun_path))
+			return listeningFds;
+		address.sun_family = AF_UNIX;
+		std::memcpy(address.sun_path, path.c_str(), path.size());
+
+		int askSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(askSocket < 0)
+			return listeningFds;
+		uint16_t wantedPort = htons(port);
+#if defined(MSG_NOSIGNAL)
+		const int sendFlags = MSG_NOSIGNAL;
+#else
+		const int sendFlags = 0;
+#endif
+		if(connect(askSocket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0 &&
+			send(askSocket, &wantedPort, sizeof(wantedPort), sendFlags) == sizeof(wantedPort) && HandOffWait(askSocket, timeoutSeconds))
+		{
+			char data = 0;
+			iovec vector;
+			vector.iov_base = &data;
+			vector.iov_len = 1;
+			const size_t maxFdBytes = maxHandOffSockets * sizeof(int);
+			std::vector<cmsghdr> control((CMSG_SPACE(maxFdBytes) + sizeof(cmsghdr) - 1) / sizeof(cmsghdr));
+
+			msghdr message;
+			std::memset(&message, 0, sizeof(message));
+			message.msg_iov = &vector;
+			message.msg_iovlen = 1;
+			message.msg_control = control.data();
+			message.msg_controllen = CMSG_SPACE(maxFdBytes);
+			if(recvmsg(askSocket, &message, 0) == 1)
+			{
+				cmsghdr *header = CMSG_FIRSTHDR(&message);
+				if(header && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+				{
+					listeningFds.resize((header->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+					std::memcpy(listeningFds.data(), CMSG_DATA(header), listeningFds.size() * sizeof(int));
+				}
+			}
+		}
+		close(askSocket);
+#endif
+		return listeningFds;
+	}
+}
+
+// poll set helpers, the cooperative Update waits on an epoll set where there is one and polls every
+//    connection in turn otherwise
+namespace
+{
+	// Makes an empty set.
+	// return : the set's descriptor, or -1 if there are no poll sets here
+	int PollSetCreate(void)
+	{
+#if defined(__linux__)
+		return epoll_create1(EPOLL_CLOEXEC);
+#else
+		return -1;
+#endif
+	}
+
+	// Adds a descriptor to wait for it to be readable.
+	// tag : given back by PollSetWait when the descriptor is ready
+	// return : true if it was added
+	bool PollSetAdd(int pollSet, int fd, void *tag)
+	{
+#if defined(__linux__)
+		epoll_event event;
+		std::memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = tag;
+		return pollSet >= 0 && fd >= 0 && epoll_ctl(pollSet, EPOLL_CTL_ADD, fd, &event) == 0;
+#else
+		return false;
+#endif
+	}
+
+	void PollSetRemove(int pollSet, int fd)
+	{
+#if defined(__linux__)
+		if(pollSet >= 0 && fd >= 0)
+			epoll_ctl(pollSet, EPOLL_CTL_DEL, fd, nullptr);
+#endif
+	}
+
+	// Waits for descriptors in the set to be readable.
+	// waitMs : the longest time to wait, 0 to only check
+	// outTags, maxTags : where the tags of the ready descriptors go
+	// return : the number of tags
+	int PollSetWait(int pollSet, int waitMs, void **outTags, int maxTags)
+	{
+#if defined(__linux__)
+		const int maxEvents = 64;
+		epoll_event events[maxEvents];
+		int ready = epoll_wait(pollSet, events, std::min(maxTags, maxEvents), waitMs);
+		for(int i = 0; i < ready; ++i)
+			outTags[i] = events[i].data.ptr;
+		return std::max(ready, 0);
+#else
+		return 0;
+#endif
+	}
+
+	// Checks if the other end closed a connection and there is nothing left to read from it.
+	bool PeerClosed(int handle)
+	{
+#if defined(__GNUC__)
+		char data;
+		return handle >= 0 && recv(handle, &data, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+#else
+		return false;
+#endif
+	}
+
+	// Waits for one descriptor to be readable, or closed.
+	// waitMs : the longest time to wait
+	void WaitReadable(int handle, int waitMs)
+	{
+#if defined(__GNUC__)
+		pollfd dataCheck;
+		dataCheck.fd = handle;
+		dataCheck.events = POLLIN;
+		dataCheck.revents = 0;
+		poll(&dataCheck, 1, waitMs);
+#else
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+#endif
+	}
+
+	void PollSetClose(int pollSet)
+	{
+#if defined(__linux__)
+		if(pollSet >= 0)
+			close(pollSet);
+#endif
+	}
+}
+
+
+// netfunc TimerWheel definitions
+namespace netfunc
+{
+	namespace
+	{
+		void TimerUnlink(TimerWheel::Timer &timer)
+		{
+			timer.prev->next = timer.next;
+			timer.next->prev = timer.prev;
+			timer.next = nullptr;
+			timer.prev = nullptr;
+		}
+
+		void TimerLinkBefore(TimerWheel::Timer &head, TimerWheel::Timer &timer)
+		{
+			timer.prev = head.prev;
+			timer.next = &head;
+			head.prev->next = &timer;
+			head.prev = &timer;
+		}
+	}
+
+	const uint32_t TimerWheel::slotBits;
+	const uint32_t TimerWheel::slotCount;
+	const uint32_t TimerWheel::levelCount;
+
+	TimerWheel::TimerWheel() : start(std::chrono::steady_clock::now())
+	{
+		for(auto &level : slots)
+			for(auto &slot : level)
+				slot.next = slot.prev = &slot;
+	}
+
+	// Schedules a timer, or moves it if it is scheduled already.
+	// due : the timer comes due on the first tick at or after it
+	void TimerWheel::Schedule(Timer &timer, std::chrono::steady_clock::time_point due)
+	{
+		Cancel(timer);
+		int64_t sinceStart = std::chrono::duration_cast<std::chrono::nanoseconds>(due - start).count();
+		timer.dueTick = sinceStart <= 0 ? 0 : uint64_t(sinceStart + 999999) / 1000000;
+		HelperInsert(timer);
+		++count;
+	}
+
+	// Takes a timer off the wheel, it may or may not be scheduled.
+	void TimerWheel::Cancel(Timer &timer)
+	{
+		if(!timer.Scheduled())
+			return;
+		TimerUnlink(timer);
+		--count;
+	}
+
+	// Turns the wheel up to now, every timer that came due is taken off it and passed to expired.
+	void TimerWheel::Advance(std::chrono::steady_clock::time_point now, std::function<void(Timer&)> const &expired)
+	{
+		int64_t sinceStart = std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count();
+		if(sinceStart < 0)
+			return;
+		uint64_t nowTick = uint64_t(sinceStart);
+		for(; currentTick <= nowTick; ++currentTick)
+		{
+			// nothing left to come due, the wheel can jump ahead
+			if(count == 0)
+			{
+				currentTick = nowTick + 1;
+				break;
+			}
+
+			// when a wheel comes around, the next slot of the one above is spread over the wheels below
+			for(uint32_t level = 1; level < levelCount; ++level)
+			{
+				uint32_t shift = slotBits * level;
+				if((currentTick & ((uint64_t(1) << shift) - 1)) != 0)
+					break;
+				Timer &head = slots[level][(currentTick >> shift) & (slotCount - 1)];
+				while(head.next != &head)
+				{
+					Timer &timer = *head.next;
+					TimerUnlink(timer);
+					HelperInsert(timer);
+				}
+			}
+
+			// the slot is moved aside first, expired may schedule and cancel timers, even into this slot again
+			Timer &head = slots[0][currentTick & (slotCount - 1)];
+			while(head.next != &head)
+			{
+				Timer due;
+				due.next = head.next;
+				due.prev = head.prev;
+				due.next->prev = &due;
+				due.prev->next = &due;
+				head.next = head.prev = &head;
+				while(due.next != &due)
+				{
+					Timer &timer = *due.next;
+					TimerUnlink(timer);
+					if(timer.dueTick > currentTick)
+					{
+						HelperInsert(timer);
+						continue;
+					}
+					--count;
+					expired(timer);
+				}
+			}
+		}
+	}
+
+	// Gets a time no later than when the next timer comes due. Timers on the coarser wheels count as due
+	//    when they are spread over the wheels below.
+	// return : false if no timer is scheduled
+	bool TimerWheel::NextDue(std::chrono::steady_clock::time_point &outDue) const
+	{
+		if(count == 0)
+			return false;
+		uint64_t dueTick = ~uint64_t(0);
+		for(uint32_t level = 0; level < levelCount; ++level)
+		{
+			uint32_t shift = slotBits * level;
+			uint64_t base = currentTick >> shift;
+			for(uint64_t i = 0; i <= slotCount; ++i)
+			{
+				uint64_t tick = (base + i) << shift;
+				if(tick < currentTick)
+					continue;
+				Timer const &head = slots[level][(base + i) & (slotCount - 1)];
+				if(head.next != &head)
+				{
+					dueTick = std::min(dueTick, tick);
+					break;
+				}
+			}
+		}
+		outDue = start + std::chrono::milliseconds(dueTick);
+		return true;
+	}
+
+	// Links a timer into the slot for its tick, on the finest wheel that reaches that far.
+	void TimerWheel::HelperInsert(Timer &timer)
+	{
+		uint64_t dueTick = std::max(timer.dueTick, currentTick);
+		uint64_t delta = dueTick - currentTick;
+		uint32_t level = 0;
+		while(level + 1 < levelCount && delta >= (uint64_t(1) << (slotBits * (level + 1))))
+			++level;
+
+		// past the last wheel it waits in the farthest slot and is placed again when that comes around
+		uint64_t reach = uint64_t(1) << (slotBits * levelCount);
+		if(delta >= reach)
+			dueTick = currentTick + reach - 1;
+		TimerLinkBefore(slots[level][(dueTick >> (slotBits * level)) & (slotCount - 1)], timer);
+	}
+}
+
+// netfunc RequestArena definitions
+namespace netfunc
+{
+	namespace
+	{
+		// every allocation is prefixed with a tag saying where it came from, sized to keep the alignment
+		const size_t arenaTagBytes = 16;
+		const char arenaTagHeap = 0;
+		const char arenaTagArena = 1;
+	}
+
+	const size_t RequestArena::blockBytes;
+	const size_t RequestArena::maxKeptBytes;
+
+	// The arena for the calling thread.
+	RequestArena &RequestArena::ThreadArena(void)
+	{
+		static thread_local RequestArena arena;
+		return arena;
+	}
+
+	// Returns memory for sizeBytes, the memory is tagged so Deallocate knows where it came from.
+	void *RequestArena::Allocate(size_t sizeBytes)
+	{
+		size_t fullBytes = (sizeBytes + arenaTagBytes + arenaTagBytes - 1) & ~(arenaTagBytes - 1);
+		RequestArena &arena = ThreadArena();
+		if(arena.activeScopes == 0 || arena.pausedScopes != 0)
+		{
+			char *memory = static_cast<char*>(::operator new(fullBytes));
+			*memory = arenaTagHeap;
+			return memory + arenaTagBytes;
+		}
+
+		// find a block with room, reusing the ones kept from earlier requests
+		while(arena.currentBlock < arena.blocks.size() && 
+			arena.currentOffset + fullBytes > arena.blocks[arena.currentBlock].sizeBytes)
+		{
+			++arena.currentBlock;
+			arena.currentOffset = 0;
+		}
+		if(arena.currentBlock == arena.blocks.size())
+		{
+			Block block;
+			block.sizeBytes = std::max(blockBytes, fullBytes);
+			block.memory.reset(new char[block.sizeBytes]);
+			arena.blocks.push_back(std::move(block));
+			arena.currentOffset = 0;
+		}
+
+		char *memory = arena.blocks[arena.currentBlock].memory.get() + arena.currentOffset;
+		arena.currentOffset += fullBytes;
+		*memory = arenaTagArena;
+		return memory + arenaTagBytes;
+	}
+
+	// Gives heap memory back, arena memory is only reclaimed when the arena resets.
+	void RequestArena::Deallocate(void *memory)
+	{
+		char *tagged = static_cast<char*>(memory) - arenaTagBytes;
+		if(*tagged == arenaTagHeap)
+			::operator delete(tagged);
+	}
+
+	RequestArenaScope::RequestArenaScope()
+	{
+		++RequestArena::ThreadArena().activeScopes;
+	}
+
+	RequestArenaScope::~RequestArenaScope()
+	{
+		RequestArena &arena = RequestArena::ThreadArena();
+		if(--arena.activeScopes != 0)
+			return;
+
+		// reset, keeping enough blocks for the next request
+		size_t keptBytes = 0;
+		size_t keptBlocks = 0;
+		while(keptBlocks < arena.blocks.size() && keptBytes + arena.blocks[keptBlocks].sizeBytes <= RequestArena::maxKeptBytes)
+			keptBytes += arena.blocks[keptBlocks++].sizeBytes;
+		arena.blocks.resize(keptBlocks);
+		arena.currentBlock = 0;
+		arena.currentOffset = 0;
+	}
+
+	RequestArenaPause::RequestArenaPause()
+	{
+		++RequestArena::ThreadArena().pausedScopes;
+	}
+
+	RequestArenaPause::~RequestArenaPause()
+	{
+		--RequestArena::ThreadArena().pausedScopes;
+	}
+}
+
+
+// netfunc ResponseCache definitions
+namespace netfunc
+{
+	ResponseCache::Shard &ResponseCache::HelperShard(std::string const &key)
+	{
+		return shards[std::hash<std::string>()(key) % shardCount];
+	}
+
+	void ResponseCache::HelperErase(Shard &shard, OrderList::iterator it)
+	{
+		shard.usedBytes -= it->second->sizeBytes + it->second->attachmentBytes + it->first.size() * 2;
+		shard.lookup.erase(it->first);
+		shard.order.erase(it);
+	}
+
+	// Sets the total number of bytes the cache can hold, existing entries are dropped.
+	void ResponseCache::SetMaxBytes(size_t maxBytes)
+	{
+		Clear();
+		maxBytesPerShard = maxBytes / shardCount;
+	}
+
+	// Looks up a response, returns nullptr if it is not cached or has expired.
+	std::shared_ptr<ResponseCache::Entry const> ResponseCache::Find(std::string const &key)
+	{
+		Shard &shard = HelperShard(key);
+		std::lock_guard<std::mutex> guard(shard.lock);
+
+		auto found = shard.lookup.find(key);
+		if(found == shard.lookup.end())
+			return nullptr;
+
+		OrderList::iterator it = found->second;
+		if(it->second->expires && std::chrono::steady_clock::now() >= it->second->expireTime)
+		{
+			HelperErase(shard, it);
+			return nullptr;
+		}
+
+		// move to the front so it is the last to be evicted
+		shard.order.splice(shard.order.begin(), shard.order, it);
+		return it->second;
+	}
+
+	// Adds a response, evicting the least recently used entries if the shard is full.
+	void ResponseCache::Insert(std::string const &key, std::shared_ptr<Entry const> entry)
+	{
+		size_t entryBytes = entry->sizeBytes + entry->attachmentBytes + key.size() * 2;
+		Shard &shard = HelperShard(key);
+		std::lock_guard<std::mutex> guard(shard.lock);
+		if(entryBytes > maxBytesPerShard)
+			return;
+
+		auto found = shard.lookup.find(key);
+		if(found != shard.lookup.end())
+			HelperErase(shard, found->second);
+
+		while(shard.usedBytes + entryBytes > maxBytesPerShard && !shard.order.empty())
+			HelperErase(shard, std::prev(shard.order.end()));
+
+		shard.order.emplace_front(key, std::move(entry));
+		shard.lookup.emplace(key, shard.order.begin());
+		shard.usedBytes += entryBytes;
+	}
+
+	// Drops all entries whose key starts with prefix.
+	void ResponseCache::ErasePrefix(std::string const &prefix)
+	{
+		for(Shard &shard : shards)
+		{
+			std::lock_guard<std::mutex> guard(shard.lock);
+			for(OrderList::iterator it = shard.order.begin(); it != shard.order.end();)
+			{
+				OrderList::iterator next = std::next(it);
+				if(it->first.compare(0, prefix.size(), prefix) == 0)
+					HelperErase(shard, it);
+				it = next;
+			}
+		}
+	}
+
+	// Drops all entries.
+	void ResponseCache::Clear(void)
+	{
+		for(Shard &shard : shards)
+		{
+			std::lock_guard<std::mutex> guard(shard.lock);
+			shard.lookup.clear();
+			shard.order.clear();
+			shard.usedBytes = 0;
+		}
+	}
+}
+
+
+// netfunc Attachments definitions
+namespace netfunc
+{
+	Attachments &Attachments::operator=(Attachments &&other)
+	{
+		if(this != &other)
+		{
+			Clear();
+			parts = std::move(other.parts);
+			received = std::move(other.received);
+			totalBytes = other.totalBytes;
+			other.parts.clear();
+			other.totalBytes = 0;
+		}
+		return *this;
+	}
+
+	bool Attachments::HelperAdd(std::string const &name, char const *data, size_t sizeBytes, std::unique_ptr<char[]> copy)
+	{
+		if(totalBytes + sizeBytes > maxMessageBytes)
+		{
+			BufferPool::Release(copy, uint32_t(sizeBytes));
+			return false;
+		}
+
+		Part part;
+		part.name = name;
+		part.data = data;
+		part.sizeBytes = sizeBytes;
+		part.copy = std::move(copy);
+		parts.push_back(std::move(part));
+		totalBytes += sizeBytes;
+		return true;
+	}
+
+	// Adds a copy of the bytes.
+	// return : false if the attachments would no longer fit in one message
+	bool Attachments::Add(std::string const &name, void const *data, size_t sizeBytes)
+	{
+		if(totalBytes + sizeBytes > maxMessageBytes)
+			return false;
+		std::unique_ptr<char[]> copy = BufferPool::Acquire(uint32_t(sizeBytes));
+		std::memcpy(copy.get(), data, sizeBytes);
+		char const *copyData = copy.get();
+		return HelperAdd(name, copyData, sizeBytes, std::move(copy));
+	}
+
+	// Adds the bytes without copying them, they have to stay valid until the attachments are sent.
+	// return : false if the attachments would no longer fit in one message
+	bool Attachments::AddView(std::string const &name, void const *data, size_t sizeBytes)
+	{
+		return HelperAdd(name, static_cast<char const*>(data), sizeBytes, nullptr);
+	}
+
+	// Looks up an attachment by name.
+	// return : true if found, the data and size are set to the attachment
+	bool Attachments::Find(std::string const &name, char const *&outData, size_t &outSizeBytes) const
+	{
+		for(Part const &part : parts)
+		{
+			if(part.name == name)
+			{
+				outData = part.data;
+				outSizeBytes = part.sizeBytes;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Removes all attachments.
+	void Attachments::Clear(void)
+	{
+		for(Part &part : parts)
+			BufferPool::Release(part.copy, uint32_t(part.sizeBytes));
+		parts.clear();
+		BufferPool::Release(received, maxMessageBytes);
+		totalBytes = 0;
+	}
+
+	// The names and sizes of the attachments, sent in the json so the other side can split the message.
+	json Attachments::Describe(void) const
+	{
+		json description = json::array();
+		for(Part const &part : parts)
+			description.push_back(json::array({ part.name, part.sizeBytes }));
+		return description;
+	}
+
+	// The memory to send, one span per attachment.
+	void Attachments::Spans(std::vector<SendSpan> &outSpans) const
+	{
+		outSpans.clear();
+		for(Part const &part : parts)
+		{
+			SendSpan span = { part.data, part.sizeBytes };
+			outSpans.push_back(span);
+		}
+	}
+
+	// Takes over a received message and makes views into it, using the description from the other side.
+	// buffer : the message, acquired from BufferPool for maxMessageBytes, this object keeps it until cleared
+	// return : false if the description doesn't match the message
+	bool Attachments::Receive(std::unique_ptr<char[]> &buffer, uint16_t sizeBytes, json const &description)
+	{
+		Clear();
+		if(!description.is_array())
+			return false;
+
+		size_t offset = 0;
+		for(auto const &entry : description)
+		{
+			if(!entry.is_array() || entry.size() != 2 || !entry[0].is_string() || !entry[1].is_number_unsigned())
+				break;
+			size_t partBytes = entry[1];
+			if(offset + partBytes > sizeBytes)
+				break;
+
+			Part part;
+			part.name = entry[0].get<std::string>();
+			part.data = buffer.get() + offset;
+			part.sizeBytes = partBytes;
+			parts.push_back(std::move(part));
+			offset += partBytes;
+		}
+
+		// views are only handed out if the whole message was described
+		if(parts.size() != description.size() || offset != sizeBytes)
+		{
+			parts.clear();
+			return false;
+		}
+		totalBytes = offset;
+		received = std::move(buffer);
+		return true;
+	}
+}
+
+
+// netfunc Listener definitions
+namespace netfunc
+{
+	// Starts the listener port and sets up the backend to start accepting and handling requests.
+	// port : the port to setup and listen on
+	// helperNum : maximum number of helper threads
+	//    if this is 0, no threads will be created and all work will be done on the calls to Update
+	//    if otherwise, a thread will be created for accepting and processing requests as needed
+	// acceptQueueSize : size of the accept queue passed into Listen
+	// timeoutSeconds : the maximum amount of time a connection should wait for data from the requester
+	ErrorResult Listener::Start(uint16_t port, uint16_t helperNum, uint16_t acceptQueueSize, float timeoutSeconds)
+	{
+		if(running)
+			return ErrorResult::Listener_Started;
+		
+		// setup variables
+		if(listeningConnection == nullptr)
+#if defined(__GNUC__)
+			listeningConnection.reset(new DefaultConnection());
+#else
+			return ErrorResult::No_Default;
+#endif
+
+		if(serializeFunction == nullptr || deserializeFunction == nullptr)
+		{
+			serializeFunction = DefaultStringSerialization;
+			deserializeFunction = DefaultStringDeserialization;
+		}
+		
+		maxThreadCount = helperNum;
+		internalTimeout = timeoutSeconds;
+
+		// a new id makes requesters drop everything they cached from a previous run
+		{
+			std::lock_guard<std::mutex> guard(invalidationLock);
+			std::random_device random;
+			listenerId = (uint64_t(random()) << 32) | random();
+			invalidationSeq = 0;
+			invalidationLog.clear();
+		}
+		responseCache.Clear();
+		dedupeCache.Clear();
+
+		// start the listener sockets, or take them over from a listener that is handing off
+		std::vector<int> handedFds;
+		if(!handOffPath.empty())
+			handedFds = HandOffReceive(handOffPath, port, timeoutSeconds);
+		for(size_t i = 0; i <= endpoints.size(); ++i)
+		{
+			ConnectionBase &listening = HelperEndpoint(i);
+			listening.SetOptions(socketOptions);
+			int handedFd = i < handedFds.size() ? handedFds[i] : -1;
+			if(handedFd >= 0 && listening.AdoptListening(handedFd))
+				continue;
+			if(handedFd >= 0)
+				HandOffClose(handedFd, handOffPath, false);
+
+			bool started = listening.Setup(i == 0 ? port : endpoints[i - 1].port);
+			if(started && !listening.Listen(acceptQueueSize))
+			{
+				listening.Stop();
+				started = false;
+			}
+			if(!started)
+			{
+				// the ones that started are closed again, and the sockets that were handed over and not used yet
+				for(size_t j = 0; j < i; ++j)
+					HelperEndpoint(j).Stop();
+				for(size_t j = i + 1; j < handedFds.size(); ++j)
+					HandOffClose(handedFds[j], handOffPath, false);
+				return ErrorResult::Net_Error;
+			}
+		}
+		for(size_t i = endpoints.size() + 1; i < handedFds.size(); ++i)
+			HandOffClose(handedFds[i], handOffPath, false);
+		listenPort = port;
+		nextEndpoint = 0;
+		handedOff = false;
+		if(!handOffPath.empty())
+			handOffSocket = HandOffServe(handOffPath);
+		
+		handling = true;
+		running = true;
+
+		// the listening ports are waited on through one poll set, without helper threads Update adds the
+		//    connections it is waiting on to it
+		pollSet = PollSetCreate();
+		acceptPolled = PollSetAdd(pollSet, listeningConnection->PollHandle(), nullptr);
+		for(auto &endpoint : endpoints)
+			acceptPolled = PollSetAdd(pollSet, endpoint.connection->PollHandle(), nullptr) && acceptPolled;
+		PollSetAdd(pollSet, handOffSocket, &handOffSocket);
+		
+		// start a helper thread if helperNum is greater than 0
+		if(maxThreadCount >= 1)
+		{
+			accepting = true;
+			++activeThreadCount;
+			std::thread t(&Listener::HelperUpdateThread, this);
+			t.detach();
+			threadedError = ErrorResult::Call_Ok;
+
+			// and the warm helper threads, the accepting thread takes one of the helpers
+			for(uint32_t i = 0; i < warmThreadCount && activeThreadCount < maxThreadCount; ++i)
+			{
+				++activeThreadCount;
+				std::thread warm(&Listener::HelperParkedThread, this);
+				warm.detach();
+			}
+		}
+		else
+		{
+			// without helper threads the calls are answered on the thread calling Update, make its buffers now
+			PooledBuffer warmBuffer(maxMessageBytes);
+			std::memset(warmBuffer.buffer.get(), 0, maxMessageBytes);
+		}
+
+		// heartbeats go out from their own thread, so they keep going while functions run in either mode. It is
+		//    started by the first call that asks for them
+		heartbeatStop = false;
+		
+		return ErrorResult::Call_Ok;
+	}
+	
+	// Stops accepting right away, lets the calls in flight finish and waits for all threads to finish.
+	// drainSeconds : how long calls in flight get before their waits for the requester give up, a function
+	//    that is still running after that is waited for
+	void Listener::Stop(float drainSeconds)
+	{
+		std::unique_lock<std::mutex> guard(stopLock);
+		if(!running)
+			return;
+		running = false;
+		stopSignal.notify_all();
+		{
+			std::lock_guard<std::mutex> parkGuard(parkLock);
+			parkSignal.notify_all();
+		}
+
+		std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+			std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(drainSeconds));
+		auto drain = [&](std::function<bool(void)> const &done)
+		{
+			if(!stopSignal.wait_until(guard, deadline, done))
+			{
+				handling = false;
+				stopSignal.wait(guard, done);
+			}
+		};
+
+		// close the port as soon as the accept thread is out of its loop, so new requesters are turned away
+		//    instead of waiting in the accept queue, then wait for the calls in flight
+		drain([this]{ return !accepting; });
+		HelperStopEndpoints();
+		HandOffClose(handOffSocket, handOffPath, handOffSocket >= 0);
+		handOffSocket = -1;
+		drain([this]{ return activeThreadCount == 0; });
+
+		// without helper threads the requests already accepted are answered here
+		while(maxThreadCount == 0 && !waiting.empty() && std::chrono::steady_clock::now() < deadline)
+		{
+			HelperPoll(10);
+			HelperAdvance();
+		}
+		HelperDropWaiting();
+		handling = false;
+
+		{
+			std::lock_guard<std::mutex> heartbeatGuard(heartbeatLock);
+			heartbeatStop = true;
+			heartbeatSignal.notify_all();
+		}
+		if(heartbeatThread.joinable())
+			heartbeatThread.join();
+	}
+	
+	// Drops the cached responses of a function and tells requesters with cached results for it that they are
+	//    no longer valid. Can be called while the listener is running.
+	// name : the name bound to the function
+	void Listener::Invalidate(std::string const &name)
+	{
+		std::lock_guard<std::mutex> guard(invalidationLock);
+		++invalidationSeq;
+		invalidationLog.emplace_back(invalidationSeq, name);
+		while(invalidationLog.size() > maxInvalidationLog)
+			invalidationLog.pop_front();
+		responseCache.ErasePrefix(name + '\0');
+	}
+
+	// Add another port to listen on with the default connection class.
+	ErrorResult Listener::AddEndpoint(uint16_t port)
+	{
+		if(running)
+			return ErrorResult::Listener_Started;
+#if defined(__GNUC__)
+		endpoints.push_back({ std::unique_ptr<ConnectionBase>(new DefaultConnection()), port });
+		return ErrorResult::Call_Ok;
+#else
+		return ErrorResult::No_Default;
+#endif
+	}
+
+	// Add a unix socket to listen on, requesters reach it with "unix:" and the path as the address.
+	// path : where the unix socket is made, whatever was there is removed
+	ErrorResult Listener::AddLocalEndpoint(std::string const &path)
+	{
+		if(running)
+			return ErrorResult::Listener_Started;
+#if defined(__GNUC__)
+		endpoints.push_back({ std::unique_ptr<ConnectionBase>(new DefaultConnection(path)), 0 });
+		return ErrorResult::Call_Ok;
+#else
+		return ErrorResult::No_Default;
+#endif
+	}
+
+	// Take a function out of the listening system, its name goes to the default function from then on.
+	// name : the name bound to the function
+	void Listener::RemoveFunction(std::string const &name)
+	{
+		bool removed = false;
+		HelperChangeTable([&](FunctionTable &table)
+		{
+			removed = table.functions.erase(name) != 0;
+			return ErrorResult::Call_Ok;
+		});
+		if(removed)
+			Invalidate(name);
+	}
+
+	// Adds a function to a copy of the table and publishes it.
+	// replace : swap out a function that has the name already instead of failing
+	ErrorResult Listener::HelperAddEntry(std::string const &name, FunctionEntry const &entry, bool replace)
+	{
+		bool replaced = false;
+		ErrorResult result = HelperChangeTable([&](FunctionTable &table)
+		{
+			// runs under the table lock, so every published entry gets its own generation
+			FunctionEntry published = entry;
+			published.generation = ++tableGeneration;
+			auto found = table.functions.find(name);
+			if(found == table.functions.end())
+				table.functions.emplace(name, published);
+			else if(!replace)
+				return ErrorResult::Func_Overwrite;
+			else
+			{
+				found->second = published;
+				replaced = true;
+			}
+			return ErrorResult::Call_Ok;
+		});
+		if(replaced)
+			Invalidate(name);
+		return result;
+	}
+
+	// Makes the change to a copy of the function table and publishes the copy. Once the epoch has moved on,
+	//    the readers that could have the old table are the ones counted for the epoch before, and the old
+	//    table is freed when they are done.
+	// change : changes the table, the table is published if it returns Call_Ok
+	ErrorResult Listener::HelperChangeTable(std::function<ErrorResult(FunctionTable&)> const &change)
+	{
+		std::lock_guard<std::mutex> guard(tableLock);
+		FunctionTable const *oldTable = functionTable.load();
+		std::unique_ptr<FunctionTable> newTable(oldTable ? new FunctionTable(*oldTable) : new FunctionTable());
+		ErrorResult result = change(*newTable);
+		if(result != ErrorResult::Call_Ok)
+			return result;
+
+		functionTable.store(newTable.release());
+		unsigned int oldEpoch = tableEpoch.fetch_add(1);
+		while(tableReaders[oldEpoch & 1] != 0)
+			std::this_thread::yield();
+		delete oldTable;
+		return ErrorResult::Call_Ok;
+	}
+
+	// Looks up a function in the published table without locking. A reader counts itself for the epoch it
+	//    saw, and starts over if the epoch moved on before it was counted, since the writer may not have
+	//    waited for it.
+	// return : true if a function has the name
+	// outEntry : the function with the name
+	// outDefault : the default function, used when no function has the name
+	bool Listener::HelperFindFunction(std::string const &name, FunctionEntry &outEntry, NetFuncType &outDefault)
+	{
+		unsigned int epoch = 0;
+		for(;;)
+		{
+			epoch = tableEpoch.load();
+			++tableReaders[epoch & 1];
+			if(tableEpoch.load() == epoch)
+				break;
+			--tableReaders[epoch & 1];
+		}
+
+		bool found = false;
+		outDefault = nullptr;
+		FunctionTable const *table = functionTable.load();
+		if(table)
+		{
+			auto foundFunc = table->functions.find(name);
+			found = foundFunc != table->functions.end();
+			if(found)
+				outEntry = foundFunc->second;
+			outDefault = table->defaultFunction;
+		}
+		--tableReaders[epoch & 1];
+		return found;
+	}
+
+	// Trys to accept and process requests.
+	// timeoutSeconds : the amount of time that should pass before the function stops accepting new requests and return
+	ErrorResult Listener::Update(float timeoutSeconds)
+	{
+		try
+		{
+			if(running)
+			{
+				if(maxThreadCount == 0)
+					return HelperCooperative(timeoutSeconds);
+				else
+					return threadedError;
+			}
+			else
+				return ErrorResult::Net_Error;
+		}
+		catch(...)
+		{
+			return ErrorResult::Net_Error;
+		}
+	}
+	
+	ErrorResult Listener::HelperUpdate(float timeoutSeconds)
+	{
+		std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+		for(;;)
+		{
+			// check for timeout
+			std::chrono::steady_clock::time_point nowTime = std::chrono::steady_clock::now();
+			HelperCheckHandOff();
+			if(!running || handedOff || std::chrono::duration_cast<std::chrono::duration<double>>(nowTime-startTime).count() > timeoutSeconds)
+			{
+				return ErrorResult::Call_Ok;
+			}
+			
+			// try to get a connection
+			std::unique_ptr<ConnectionBase> newConnection;
+			if(!HelperAccept(newConnection))
+				return ErrorResult::Net_Error;
+			
+			// wait for the next one on the poll set instead of checking every millisecond, running is still
+			//    looked at every few milliseconds
+			if(!newConnection)
+			{
+				if(pollSet >= 0 && acceptPolled)
+				{
+					void *tags[1];
+					PollSetWait(pollSet, runningCheckMs, tags, 1);
+				}
+				else
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			else
+			{
+				// give the request to a warm thread, or make new thread for it if can, otherwise run in this thread
+				if(HelperHandToParked(newConnection))
+					continue;
+				if(activeThreadCount < maxThreadCount)
+				{
+					++activeThreadCount;
+					std::thread t(&Listener::HelperWorkThread, this, std::move(newConnection));
+					t.detach();
+				}
+				else
+				{
+					ErrorResult result = HelperWork(newConnection);
+					newConnection->Stop();
+					if(result != ErrorResult::Call_Ok)
+						return result;
+				}
+			}
+		}
+	}
+	
+	void Listener::HelperUpdateThread(void)
+	{
+		try
+		{
+			while(running && !handedOff)
+			{
+				if(HelperUpdate(5) == ErrorResult::Net_Error)
+				{
+					threadedError = ErrorResult::Net_Error;
+					break;
+				}
+			}
+		}
+		catch(...){}
+		HelperThreadExit(true);
+	}
+
+	// A warm helper thread, it makes the buffers a call needs and then answers the connections it is given
+	//    until the listener stops.
+	void Listener::HelperParkedThread(void)
+	{
+		try
+		{
+			{
+				PooledBuffer warmBuffer(maxMessageBytes);
+				std::memset(warmBuffer.buffer.get(), 0, maxMessageBytes);
+			}
+
+			for(;;)
+			{
+				std::unique_ptr<ConnectionBase> connection;
+				{
+					std::unique_lock<std::mutex> guard(parkLock);
+					++parkedThreads;
+					parkSignal.wait(guard, [this]{ return !parkedWork.empty() || !running; });
+					--parkedThreads;
+					if(parkedWork.empty())
+						break;
+					connection = std::move(parkedWork.back());
+					parkedWork.pop_back();
+				}
+				HelperWork(connection);
+				connection->Stop();
+			}
+		}
+		catch(...){}
+		HelperThreadExit(false);
+	}
+
+	// Gives a connection to a warm thread that is waiting for one.
+	// return : true if a thread took it
+	bool Listener::HelperHandToParked(std::unique_ptr<ConnectionBase> &connection)
+	{
+		std::lock_guard<std::mutex> guard(parkLock);
+		if(parkedThreads <= parkedWork.size())
+			return false;
+		parkedWork.push_back(std::move(connection));
+		parkSignal.notify_one();
+		return true;
+	}
+
+	// Waits a while after answering to let the network do its thing, unless the listener is stopping.
+	void Listener::HelperLinger(void)
+	{
+		std::unique_lock<std::mutex> guard(stopLock);
+		stopSignal.wait_for(guard, std::chrono::milliseconds(500), [this]{ return !running; });
+	}
+
+	// Counts a helper thread out and wakes Stop. The signal is sent under the lock, since Stop may return and
+	//    the listener be destroyed as soon as the lock is released.
+	// acceptThread : the thread was the one accepting connections
+	void Listener::HelperThreadExit(bool acceptThread)
+	{
+		std::lock_guard<std::mutex> guard(stopLock);
+		if(acceptThread)
+			accepting = false;
+		--activeThreadCount;
+		stopSignal.notify_all();
+	}
+	
+	// Runs the requests of the cooperative Update until timeoutSeconds have passed. Connections are accepted
+	//    as they come in and each one is answered once its whole request has arrived, in between it waits on
+	//    the poll set and the timers.
+	ErrorResult Listener::HelperCooperative(float timeoutSeconds)
+	{
+		std::chrono::steady_clock::time_point endTime = std::chrono::steady_clock::now() +
+			std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(timeoutSeconds));
+		bool acceptReady = HelperPoll(0);
+		for(;;)
+		{
+			// take every connection waiting to be accepted, unless a new listener took the port over
+			HelperCheckHandOff();
+			while(acceptReady && !handedOff)
+			{
+				std::unique_ptr<ConnectionBase> newConnection;
+				if(!HelperAccept(newConnection))
+					return ErrorResult::Net_Error;
+				if(!newConnection)
+					break;
+
+				waiting.emplace_back();
+				Waiting &entry = waiting.back();
+				entry.self = std::prev(waiting.end());
+				entry.connection = std::move(newConnection);
+				entry.lastActive = std::chrono::steady_clock::now();
+				entry.deadline = entry.lastActive +
+					std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(internalTimeout));
+				entry.heldBytes = sizeof(Waiting) + entry.connection->HeldBytes();
+				entry.queuedIndex = notQueued;
+				entry.polled = PollSetAdd(pollSet, entry.connection->PollHandle(), &entry);
+				entry.answered = false;
+				if(!entry.polled)
+					++unpolledCount;
+
+				// a new connection may have its request waiting already
+				entry.ready = true;
+				HelperQueue(entry);
+				HelperSchedule(entry);
+			}
+			HelperLimitWaiting();
+
+			ErrorResult result = HelperAdvance();
+			if(result != ErrorResult::Call_Ok)
+				return result;
+
+			// wait until something can be read, a timer comes due or the call is over, what can't be polled is
+			//    checked every millisecond
+			std::chrono::steady_clock::time_point nowTime = std::chrono::steady_clock::now();
+			if(!running || nowTime >= endTime)
+				return ErrorResult::Call_Ok;
+			std::chrono::steady_clock::time_point wakeTime = endTime;
+			std::chrono::steady_clock::time_point dueTime;
+			if(timers.NextDue(dueTime))
+				wakeTime = std::min(wakeTime, dueTime);
+			bool checkOften = !acceptPolled || unpolledCount != 0;
+			int waitMs = int(std::chrono::duration_cast<std::chrono::milliseconds>(wakeTime - nowTime).count()) + 1;
+			acceptReady = HelperPoll(checkOften ? std::min(waitMs, 1) : waitMs);
+		}
+	}
+
+	// Waits for the poll set, queueing the connections that can be read.
+	// waitMs : the longest time to wait
+	// return : true if the listening port may have a connection to accept
+	bool Listener::HelperPoll(int waitMs)
+	{
+		if(pollSet < 0)
+		{
+			if(waitMs > 0)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			for(auto &entry : waiting)
+			{
+				entry.ready = true;
+				HelperQueue(entry);
+			}
+			return true;
+		}
+
+		const int maxTags = 64;
+		void *tags[maxTags];
+		int tagCount = PollSetWait(pollSet, waitMs, tags, maxTags);
+		bool acceptReady = !acceptPolled;
+		for(int i = 0; i < tagCount; ++i)
+		{
+			if(tags[i] == nullptr)
+				acceptReady = true;
+			else if(tags[i] != &handOffSocket)
+			{
+				Waiting &entry = *static_cast<Waiting*>(tags[i]);
+				entry.ready = true;
+				HelperQueue(entry);
+			}
+		}
+
+		// connections that can't be polled are tried every time
+		if(unpolledCount != 0)
+		{
+			for(auto &entry : waiting)
+			{
+				if(!entry.polled && !entry.answered)
+				{
+					entry.ready = true;
+					HelperQueue(entry);
+				}
+			}
+		}
+		return acceptReady;
+	}
+
+	// Moves the queued connections along, the ones that can be read and the ones whose timer came due. Ones
+	//    that have their whole request are answered, ones that were answered are closed once they lingered long
+	//    enough and the rest are dropped when they run out of time or sit idle too long.
+	// return : the first thing that went wrong with a connection
+	ErrorResult Listener::HelperAdvance(void)
+	{
+		ErrorResult firstResult = ErrorResult::Call_Ok;
+		timers.Advance(std::chrono::steady_clock::now(), [this](TimerWheel::Timer &timer)
+		{
+			HelperQueue(static_cast<Waiting&>(timer));
+		});
+
+		// once stopped the answered connections don't linger
+		if(!running)
+			for(auto &entry : waiting)
+				if(entry.answered)
+					HelperQueue(entry);
+
+		std::chrono::steady_clock::duration idleTime = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<float>(connectionLimits.idleSeconds));
+		for(size_t i = 0; i < queued.size(); ++i)
+		{
+			Waiting *entry = queued[i];
+			if(!entry)
+				continue;
+			entry->queuedIndex = notQueued;
+
+			ErrorResult result = ErrorResult::Call_Ok;
+			bool done = false;
+			bool active = false;
+			std::chrono::steady_clock::time_point nowTime = std::chrono::steady_clock::now();
+			if(entry->answered)
+				done = !running || nowTime >= entry->deadline;
+			else if(entry->ready)
+			{
+				entry->ready = false;
+				active = entry->polled;
+				PooledBuffer received(maxMessageBytes);
+				uint16_t sizeBytes = 0;
+				bool gotData = false;
+				if(!entry->connection->RecvAvailable(received.buffer.get(), received.capacityBytes, sizeBytes, gotData))
+				{
+					if(!PeerClosed(entry->connection->PollHandle()))
+						result = ErrorResult::Net_Error;
+					done = true;
+				}
+				else if(gotData)
+				{
+					// the requester gets the same half a second to read the answer as with helper threads
+					result = HelperAnswer(entry->connection, received.buffer, sizeBytes, false);
+					if(entry->polled)
+						PollSetRemove(pollSet, entry->connection->PollHandle());
+					else
+						--unpolledCount;
+					entry->answered = true;
+					nowTime = std::chrono::steady_clock::now();
+					entry->deadline = nowTime + std::chrono::milliseconds(500);
+					done = !running;
+					active = true;
+				}
+				entry->heldBytes = sizeof(Waiting) + entry->connection->HeldBytes();
+			}
+			if(!entry->answered && nowTime >= entry->deadline)
+			{
+				result = ErrorResult::Request_Timeout;
+				done = true;
+			}
+			else if(!entry->answered && entry->polled && !active && connectionLimits.idleSeconds > 0.0f &&
+				nowTime - entry->lastActive >= idleTime)
+			{
+				++idleDropped;
+				done = true;
+			}
+
+			if(done)
+				HelperDropEntry(*entry);
+			else
+			{
+				// the connection that was active last goes to the back, the quiet ones end up at the front
+				if(active)
+				{
+					entry->lastActive = nowTime;
+					waiting.splice(waiting.end(), waiting, entry->self);
+				}
+				HelperSchedule(*entry);
+			}
+			if(firstResult == ErrorResult::Call_Ok)
+				firstResult = result;
+		}
+		queued.clear();
+		HelperLimitWaiting();
+		return firstResult;
+	}
+
+	// Queues a waiting connection for the next HelperAdvance, once.
+	void Listener::HelperQueue(Waiting &entry)
+	{
+		if(entry.queuedIndex != notQueued)
+			return;
+		entry.queuedIndex = queued.size();
+		queued.push_back(&entry);
+	}
+
+	// Sets the timer of a waiting connection to the next time it has to be looked at without anything to read.
+	void Listener::HelperSchedule(Waiting &entry)
+	{
+		std::chrono::steady_clock::time_point due = entry.deadline;
+		if(!entry.answered && entry.polled && connectionLimits.idleSeconds > 0.0f)
+			due = std::min(due, entry.lastActive + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+				std::chrono::duration<float>(connectionLimits.idleSeconds)));
+		timers.Schedule(entry, due);
+	}
+
+	// Stops a waiting connection and takes it off the list, its timer and the queue.
+	void Listener::HelperDropEntry(Waiting &entry)
+	{
+		timers.Cancel(entry);
+		if(entry.queuedIndex != notQueued)
+			queued[entry.queuedIndex] = nullptr;
+		if(entry.polled && !entry.answered)
+			PollSetRemove(pollSet, entry.connection->PollHandle());
+		if(!entry.polled && !entry.answered)
+			--unpolledCount;
+		entry.connection->Stop();
+		waiting.erase(entry.self);
+	}
+
+	// Drops connections until the waiting list is within the limits, and updates the stats. The answered ones
+	//    only linger for the requester to read and are closed first without counting them as evicted, then
+	//    the ones that have been quiet longest are dropped.
+	void Listener::HelperLimitWaiting(void)
+	{
+		size_t heldBytes = 0;
+		for(auto const &entry : waiting)
+			heldBytes += entry.heldBytes;
+		auto overLimits = [&](void)
+		{
+			return (connectionLimits.maxConnections != 0 && waiting.size() > connectionLimits.maxConnections) ||
+				(connectionLimits.maxHeldBytes != 0 && heldBytes > connectionLimits.maxHeldBytes);
+		};
+		for(auto it = waiting.begin(); it != waiting.end() && overLimits();)
+		{
+			Waiting &entry = *it++;
+			if(!entry.answered)
+				continue;
+			heldBytes -= entry.heldBytes;
+			HelperDropEntry(entry);
+		}
+		while(!waiting.empty() && overLimits())
+		{
+			heldBytes -= waiting.front().heldBytes;
+			HelperDropEntry(waiting.front());
+			++evicted;
+		}
+		waitingCount = waiting.size();
+		waitingHeldBytes = heldBytes;
+	}
+
+	// Hands the listening socket to a new listener if one is asking for it. Once it is handed off the listener
+	//    stops accepting and the hand off socket is closed, its path belongs to the new listener.
+	void Listener::HelperCheckHandOff(void)
+	{
+		if(handOffSocket < 0 || handedOff)
+			return;
+		// the sockets go in the order they were added, up to one that has no descriptor to send
+		std::vector<int> listeningFds;
+		for(size_t i = 0; i <= endpoints.size(); ++i)
+		{
+			int fd = HelperEndpoint(i).PollHandle();
+			if(fd < 0)
+				break;
+			listeningFds.push_back(fd);
+		}
+		if(HandOffAnswer(handOffSocket, listenPort, listeningFds, internalTimeout))
+		{
+			// the listening sockets stay open until Stop, they would keep waking the poll set with connections
+			//    that are for the new listener now
+			for(size_t i = 0; i <= endpoints.size(); ++i)
+				PollSetRemove(pollSet, HelperEndpoint(i).PollHandle());
+			PollSetRemove(pollSet, handOffSocket);
+			HandOffClose(handOffSocket, handOffPath, false);
+			handOffSocket = -1;
+			handedOff = true;
+		}
+	}
+
+	// Trys to accept a connection on any endpoint, starting after the one that was tried first last time so a
+	//    busy endpoint can't keep the others waiting.
+	// return : false if one of the listening connections went bad
+	// newConnection : the new connection, or nullptr if there was none
+	bool Listener::HelperAccept(std::unique_ptr<ConnectionBase> &newConnection)
+	{
+		size_t endpointCount = endpoints.size() + 1;
+		nextEndpoint = (nextEndpoint + 1) % endpointCount;
+		for(size_t i = 0; i < endpointCount && !newConnection; ++i)
+		{
+			size_t index = (nextEndpoint + i) % endpointCount;
+			ConnectionBase &listening = HelperEndpoint(index);
+			if(!listening.Accept(newConnection))
+				return false;
+		}
+		return true;
+	}
+
+	// Closes every listening connection.
+	void Listener::HelperStopEndpoints(void)
+	{
+		listeningConnection->Stop();
+		for(auto &endpoint : endpoints)
+			endpoint.connection->Stop();
+	}
+
+	// Closes the connections of the cooperative Update and its poll set.
+	void Listener::HelperDropWaiting(void)
+	{
+		for(auto &entry : waiting)
+		{
+			timers.Cancel(entry);
+			entry.connection->Stop();
+		}
+		waiting.clear();
+		queued.clear();
+		unpolledCount = 0;
+		waitingCount = 0;
+		waitingHeldBytes = 0;
+		PollSetClose(pollSet);
+		pollSet = -1;
+	}
+
+	ErrorResult Listener::HelperWork(std::unique_ptr<ConnectionBase> &connection)
+	{
+		PooledBuffer received(maxMessageBytes);
+		uint16_t sizeBytes = 0;
+		ErrorResult receiveResult = RecvMessage(*connection, received, sizeBytes, internalTimeout, &handling);
+		// a requester that connected and went away without asking for anything, like Client::Warm, isn't an error
+		if(receiveResult == ErrorResult::Net_Error && PeerClosed(connection->PollHandle()))
+			return ErrorResult::Call_Ok;
+		if(receiveResult != ErrorResult::Call_Ok)
+			return receiveResult;
+		return HelperAnswer(connection, received.buffer, sizeBytes, true);
+	}
+
+	// Answers a request that has been received.
+	// received, receivedBytes : the request message
+	// linger : wait a while after answering, the cooperative Update keeps the connection open itself
+	ErrorResult Listener::HelperAnswer(std::unique_ptr<ConnectionBase> &connection, std::unique_ptr<char[]> const &received,
+		uint16_t receivedBytes, bool linger)
+	{
+		// the json for this request is released all at once when done
+		RequestArenaScope arenaScope;
+		ErrorResult returnValue = ErrorResult::Call_Ok;
+
+		// pass buffer to deserializer, the string keeps its capacity for the next request on this thread
+		static thread_local std::string jsonString;
+		if(!deserializeFunction(received, receivedBytes, jsonString))
+			return netfunc::ErrorResult::Bad_String;
+		std::unique_ptr<char[]> buffer;
+		uint16_t sizeBytes = 0;
+
+		// deserialize json
+		json request;
+		try
+		{
+			request = json::parse(jsonString.c_str());
+		}
+		catch(...)
+		{
+			return netfunc::ErrorResult::Bad_String;
+		}
+
+		// attachments come in their own message right after the request
+		Attachments argAttachments;
+		Attachments resultAttachments;
+		FileRange file;
+		FileRangeCloser fileCloser(file);
+		{
+			auto attRef = request.find("att");
+			if(attRef != request.end())
+			{
+				PooledBuffer received(maxMessageBytes);
+				ErrorResult receiveResult = RecvMessage(*connection, received, sizeBytes, internalTimeout, &handling);
+				if(receiveResult != ErrorResult::Call_Ok)
+					return receiveResult;
+				if(!argAttachments.Receive(received.buffer, sizeBytes, *attRef))
+					return ErrorResult::Bad_Json;
+				sizeBytes = 0;
+			}
+		}
+
+		// the idempotency key this call holds, released however the call ends
+		std::string dedupeKey;
+		struct DedupeRelease
+		{
+			Listener &listener;
+			std::string &key;
+			~DedupeRelease()
+			{
+				if(key.empty())
+					return;
+				std::lock_guard<std::mutex> guard(listener.dedupeLock);
+				listener.dedupeRunning.erase(key);
+				listener.dedupeSignal.notify_all();
+			}
+		} dedupeRelease = { *this, dedupeKey };
+
+		// call function, the result is kept apart from the fields around it so the cache can hold just the result
+		json response;
+		json result;
+
+		// requesters that know the envelope ask for it, older ones get the bare result as before
+		bool envelope = request.find("env") != request.end();
+		if(envelope)
+			response["env"] = 1;
+		std::string cacheKey;
+		float cacheTtlSeconds = 0.0f;
+		uint64_t cacheGeneration = 0;
+		uint64_t currentSeq = 0;
+		{
+			auto nameRef = request.find("name");
+			auto argsRef = request.find("args");
+			if(nameRef == request.end() || argsRef == request.end())
+				return ErrorResult::Bad_Json;
+
+			// look for function, if not found and there is no default, were done here
+			FunctionEntry entry = {};
+			NetFuncType defaultFunction = nullptr;
+			bool found = HelperFindFunction(*nameRef, entry, defaultFunction);
+			if(!found && !defaultFunction)
+				return ErrorResult::Call_Ok;
+
+			if(found && entry.cacheable)
+			{
+				// objects keep their keys sorted, so the dump is the same for equal args
+				cacheKey = nameRef->get<std::string>();
+				cacheKey.push_back('\0');
+				cacheKey += argsRef->dump();
+				cacheTtlSeconds = entry.cacheTtlSeconds;
+				cacheGeneration = entry.generation;
+				if(cacheTtlSeconds > 0.0f)
+					response["ttl"] = cacheTtlSeconds;
+			}
+
+			// requesters with a cache send the listener id and the last invalidation they know about
+			{
+				std::lock_guard<std::mutex> guard(invalidationLock);
+				currentSeq = invalidationSeq;
+				auto seenRef = request.find("cache");
+				if(seenRef != request.end())
+				{
+					response["id"] = listenerId;
+					response["seq"] = currentSeq;
+					if(seenRef->is_array() && seenRef->size() == 2 && (*seenRef)[0] == listenerId && (*seenRef)[1] < currentSeq)
+					{
+						uint64_t seenSeq = (*seenRef)[1];
+						if(invalidationLog.empty() || invalidationLog.front().first > seenSeq + 1)
+							// the log no longer goes back that far, everything has to go
+							response["inv"] = "*";
+						else
+						{
+							json &names = response["inv"];
+							names = json::array();
+							for(auto const &entry : invalidationLog)
+								if(entry.first > seenSeq)
+									names.push_back(entry.second);
+						}
+					}
+				}
+			}
+
+			// send the stored result without calling the function, with this requester's fields around it. A result
+			//    of a function that was replaced since is left for the invalidation to clear
+			if(!cacheKey.empty())
+			{
+				std::shared_ptr<ResponseCache::Entry const> cached = responseCache.Find(cacheKey);
+				if(cached && cached->generation == cacheGeneration)
+				{
+					if(!envelope)
+					{
+						SendSpan part = { cached->buffer.get(), cached->sizeBytes };
+						if(!connection->SendParts(&part, 1))
+							return netfunc::ErrorResult::Net_Error;
+					}
+					else if(serializeFunction == DefaultStringSerialization)
+					{
+						// the default serialization is the text itself, so the fields can go around the stored bytes
+						std::string prefix = HelperEnvelopePrefix(response);
+						SendSpan parts[3] = { { prefix.data(), prefix.size() }, { cached->buffer.get(), cached->sizeBytes }, { "}", 1 } };
+						if(!connection->SendParts(parts, 3))
+							return netfunc::ErrorResult::Net_Error;
+					}
+					else
+					{
+						std::string cachedString;
+						if(!deserializeFunction(cached->buffer, cached->sizeBytes, cachedString))
+							return netfunc::ErrorResult::Bad_String;
+						ErrorResult sent = SendString(*connection, serializeFunction, HelperEnvelope(response, cachedString));
+						if(sent != ErrorResult::Call_Ok)
+							return sent;
+					}
+					if(linger)
+						HelperLinger();
+					return returnValue;
+				}
+			}
+
+			// a requester waiting on a long function can ask for heartbeats until the response goes out, to tell a
+			//    function that is still running from a listener that is gone. A retry waiting on the first attempt
+			//    gets them as well. Streams and uploads talk on their own
+			struct HeartbeatScope
+			{
+				Listener &listener;
+				std::list<Heartbeat>::iterator beat;
+				bool active;
+				void End(void)
+				{
+					if(!active)
+						return;
+					std::lock_guard<std::mutex> guard(listener.heartbeatLock);
+					listener.heartbeats.erase(beat);
+					active = false;
+				}
+				~HeartbeatScope() { End(); }
+			} heartbeatScope = { *this, {}, false };
+			auto beatRef = request.find("beat");
+			if(beatRef != request.end() && beatRef->is_number() && *beatRef > 0 && !(found && (entry.streamFunc || entry.uploadFunc)))
+			{
+				std::chrono::steady_clock::duration interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+					std::chrono::duration<float>(std::max(beatRef->get<float>(), minHeartbeatSeconds)));
+				std::lock_guard<std::mutex> guard(heartbeatLock);
+				try
+				{
+					if(!heartbeatThread.joinable() && !heartbeatStop)
+						heartbeatThread = std::thread(&Listener::HelperHeartbeatThread, this);
+				}
+				catch(...){}
+				if(heartbeatThread.joinable())
+				{
+					// the first one goes out right away, it tells the requester the call was picked up
+					heartbeatScope.beat = heartbeats.insert(heartbeats.end(), { connection.get(), std::chrono::steady_clock::now(), interval });
+					heartbeatScope.active = true;
+					heartbeatSignal.notify_all();
+				}
+			}
+
+			// a retry of a call that already ran gets the response it got the first time, one that is still running
+			//    waits for it. Only calls made with Send carry a key, their response is one message and maybe the
+			//    attachments. Cacheable functions can run again, so they are left to the response cache
+			auto keyRef = request.find("key");
+			if(keyRef != request.end() && keyRef->is_string() && !(found && entry.cacheable))
+			{
+				std::string key = *nameRef;
+				key.push_back('\0');
+				key += keyRef->get<std::string>();
+
+				std::unique_lock<std::mutex> guard(dedupeLock);
+				for(;;)
+				{
+					std::shared_ptr<ResponseCache::Entry const> stored = dedupeCache.Find(key);
+					if(stored)
+					{
+						guard.unlock();
+						heartbeatScope.End();
+						SendSpan part = { stored->buffer.get(), stored->sizeBytes };
+						if(!connection->SendParts(&part, 1))
+							return netfunc::ErrorResult::Net_Error;
+						SendSpan attachmentPart = { stored->attachments.get(), stored->attachmentBytes };
+						if(stored->attachments && !connection->SendParts(&attachmentPart, 1))
+							return netfunc::ErrorResult::Net_Error;
+						if(linger)
+							HelperLinger();
+						return returnValue;
+					}
+					if(dedupeRunning.insert(key).second)
+						break;
+					if(!dedupeSignal.wait_for(guard, std::chrono::duration<float>(internalTimeout),
+						[&]{ return dedupeRunning.find(key) == dedupeRunning.end(); }))
+						return ErrorResult::Request_Timeout;
+				}
+				dedupeKey = std::move(key);
+			}
+
+			if(found && entry.streamFunc)
+			{
+				// requesters using SendStream say how many chunks they can take before they have to catch up
+				auto streamRef = request.find("stream");
+				bool streamRequested = streamRef != request.end() && streamRef->is_number_integer() && *streamRef > 0;
+				uint32_t window = streamRequested ? streamRef->get<uint32_t>() : 0;
+
+				StreamWriter writer(*connection, serializeFunction, deserializeFunction, handling, internalTimeout, window, streamRequested);
+				entry.streamFunc(*argsRef, writer, result);
+				if(streamRequested && !writer.good)
+					return ErrorResult::Net_Error;
+			}
+			else if(found && entry.uploadFunc)
+			{
+				auto uploadRef = request.find("upload");
+				bool uploadRequested = uploadRef != request.end() && uploadRef->is_boolean() && *uploadRef;
+
+				StreamReader reader(*connection, deserializeFunction, handling, internalTimeout, uploadRequested);
+				entry.uploadFunc(*argsRef, reader, result);
+				if(!reader.good)
+					return ErrorResult::Net_Error;
+			}
+			else if(found && entry.attachmentFunc)
+			{
+				entry.attachmentFunc(*argsRef, argAttachments, result, resultAttachments);
+				if(resultAttachments.Count() != 0)
+					response["att"] = resultAttachments.Describe();
+			}
+			else if(found && entry.fileFunc)
+			{
+				entry.fileFunc(*argsRef, result, file);
+				if(file.fd >= 0)
+					response["file"] = file.sizeBytes;
+			}
+			else if(found)
+				entry.func(*argsRef, result);
+			else
+				defaultFunction(*argsRef, result);
+		}
+
+		// serialize result
+		std::string resultString;
+		try
+		{
+			resultString = result.dump();
+			jsonString = envelope ? HelperEnvelope(response, resultString) : resultString;
+		}
+		catch(...)
+		{
+			// if failed, send back an empty object instead
+			resultString.clear();
+			jsonString = envelope ? "{\"env\":1,\"result\":{}}" : "{}";
+			returnValue = ErrorResult::Return_Error;
+		}
+
+		bool serialized = serializeFunction(jsonString, buffer, sizeBytes);
+		if(!serialized)
+		{
+			// if failed, return something
+			buffer = BufferPool::Acquire(1);
+			*buffer.get() = 0;
+			sizeBytes = 1;
+			returnValue = ErrorResult::Return_Error;
+		}
+
+		// keep the response for retries before sending it, the requester may have given up on this attempt.
+		//    Attachments too big for a message will fail to send, so there is nothing to keep
+		std::vector<SendSpan> attachmentSpans;
+		size_t attachmentBytes = 0;
+		if(resultAttachments.Count() != 0 && envelope)
+		{
+			resultAttachments.Spans(attachmentSpans);
+			for(auto const &span : attachmentSpans)
+				attachmentBytes += span.sizeBytes;
+		}
+		if(!dedupeKey.empty() && returnValue == ErrorResult::Call_Ok && attachmentBytes <= maxMessageBytes)
+		{
+			std::shared_ptr<ResponseCache::Entry> entry(new ResponseCache::Entry());
+			entry->buffer.reset(new char[sizeBytes]);
+			std::memcpy(entry->buffer.get(), buffer.get(), sizeBytes);
+			entry->sizeBytes = sizeBytes;
+			if(!attachmentSpans.empty())
+			{
+				entry->attachments.reset(new char[attachmentBytes]);
+				char *target = entry->attachments.get();
+				for(auto const &span : attachmentSpans)
+				{
+					std::memcpy(target, span.data, span.sizeBytes);
+					target += span.sizeBytes;
+				}
+				entry->attachmentBytes = uint16_t(attachmentBytes);
+			}
+			entry->expires = true;
+			entry->expireTime = std::chrono::steady_clock::now() + 
+				std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(dedupeWindowSeconds));
+
+			std::lock_guard<std::mutex> guard(dedupeLock);
+			dedupeCache.Insert(dedupeKey, std::move(entry));
+			dedupeRunning.erase(dedupeKey);
+			dedupeSignal.notify_all();
+			dedupeKey.clear();
+		}
+
+		// send result
+		SendSpan part = { buffer.get(), sizeBytes };
+		if(!connection->SendParts(&part, 1))
+			return netfunc::ErrorResult::Net_Error;
+
+		// attachments follow in their own message, if the response describing them made it
+		if(!attachmentSpans.empty() && returnValue == ErrorResult::Call_Ok)
+		{
+			if(!connection->SendParts(attachmentSpans.data(), uint32_t(attachmentSpans.size())))
+				return netfunc::ErrorResult::Net_Error;
+		}
+
+		// and so does the file, in as many messages as it takes
+		if(file.fd >= 0 && envelope && returnValue == ErrorResult::Call_Ok)
+		{
+			if(!connection->SendFile(file.fd, file.offset, file.sizeBytes))
+				return netfunc::ErrorResult::Net_Error;
+		}
+
+		// keep the serialized result for the next call with the same args, as long as nothing was invalidated
+		//    while the function ran and the function wasn't replaced since it was looked up. The fields for this
+		//    requester are not kept, the next one gets its own. A requester without the envelope was sent just the
+		//    result, so what went out can be kept as it is
+		std::unique_ptr<char[]> cacheBuffer;
+		uint16_t cacheSizeBytes = 0;
+		if(!cacheKey.empty() && returnValue == ErrorResult::Call_Ok)
+		{
+			if(!envelope)
+			{
+				cacheBuffer.reset(new char[sizeBytes]);
+				std::memcpy(cacheBuffer.get(), buffer.get(), sizeBytes);
+				cacheSizeBytes = sizeBytes;
+			}
+			else
+			{
+				std::unique_ptr<char[]> serializedResult;
+				if(serializeFunction(resultString, serializedResult, cacheSizeBytes))
+				{
+					cacheBuffer.reset(new char[cacheSizeBytes]);
+					std::memcpy(cacheBuffer.get(), serializedResult.get(), cacheSizeBytes);
+					ReleaseSerialized(serializeFunction, serializedResult, cacheSizeBytes);
+				}
+			}
+		}
+		if(cacheBuffer)
+		{
+			// the key starts with the name
+			FunctionEntry current = {};
+			NetFuncType currentDefault = nullptr;
+			bool stillCurrent = HelperFindFunction(cacheKey.substr(0, cacheKey.find('\0')), current, currentDefault) &&
+				current.generation == cacheGeneration;
+
+			std::lock_guard<std::mutex> guard(invalidationLock);
+			if(stillCurrent && currentSeq == invalidationSeq)
+			{
+				std::shared_ptr<ResponseCache::Entry> entry(new ResponseCache::Entry());
+				entry->buffer = std::move(cacheBuffer);
+				entry->sizeBytes = cacheSizeBytes;
+				entry->generation = cacheGeneration;
+				entry->expires = cacheTtlSeconds > 0.0f;
+				entry->expireTime = std::chrono::steady_clock::now() + 
+					std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(cacheTtlSeconds));
+				responseCache.Insert(cacheKey, std::move(entry));
+			}
+		}
+		if(serialized)
+			ReleaseSerialized(serializeFunction, buffer, sizeBytes);
+		else
+			BufferPool::Release(buffer, sizeBytes);
+
+		// wait for a half a second to let network do its thing
+		if(linger)
+			HelperLinger();
+		
+		return returnValue;
+	}
+	
+	// Sends a chunk to the requester. Each chunk is sent as its own message, so it has the same size limit.
+	// return : true if the chunk was sent, false if the chunk was too big or the stream is broken
+	//    a requester that used Send instead of SendStream has no stream, every chunk will fail
+	bool StreamWriter::Write(json const &chunk)
+	{
+		if(!Good())
+			return false;
+
+		// wait for the requester to give back some of the window
+		if(credits == 0)
+		{
+			PooledBuffer received(maxMessageBytes);
+			std::string creditString;
+			while(credits == 0)
+			{
+				uint16_t sizeBytes = 0;
+				if(RecvMessage(connection, received, sizeBytes, timeoutSeconds, &running) != ErrorResult::Call_Ok)
+				{
+					good = false;
+					return false;
+				}
+
+				if(!deserializeFunction(received.buffer, sizeBytes, creditString))
+				{
+					good = false;
+					return false;
+				}
+				try
+				{
+					RequestArenaPause arenaPause;
+					json creditFrame = json::parse(creditString.c_str());
+					auto creditRef = creditFrame.find("credit");
+					if(creditRef != creditFrame.end() && creditRef->is_number_integer() && *creditRef > 0)
+						credits += creditRef->get<uint32_t>();
+				}
+				catch(...)
+				{
+					good = false;
+					return false;
+				}
+			}
+		}
+
+		// wrap the chunk without copying it into another json
+		std::string frame;
+		try
+		{
+			frame = "{\"chunk\":" + chunk.dump() + "}";
+		}
+		catch(...)
+		{
+			return false;
+		}
+
+		ErrorResult sent = SendString(connection, serializeFunction, frame);
+		if(sent == ErrorResult::Bad_String)
+			return false;
+		good = sent == ErrorResult::Call_Ok;
+		if(good)
+			--credits;
+		return good;
+	}
+
+	// Waits for the next chunk from the requester.
+	// chunk : filled with the next chunk
+	// return : true if there was a chunk, false once all of them have been read or the stream is broken
+	//    a requester that used Send instead of OpenUpload has no stream, there will be no chunks
+	bool StreamReader::Read(json &chunk)
+	{
+		if(!good || Finished())
+			return false;
+
+		PooledBuffer received(maxMessageBytes);
+		uint16_t sizeBytes = 0;
+		if(RecvMessage(connection, received, sizeBytes, timeoutSeconds, &running) != ErrorResult::Call_Ok)
+		{
+			good = false;
+			return false;
+		}
+
+		std::string chunkString;
+		if(!deserializeFunction(received.buffer, sizeBytes, chunkString))
+		{
+			good = false;
+			return false;
+		}
+		// chunks go to the heap, the function is done with each one long before the call is done
+		try
+		{
+			RequestArenaPause arenaPause;
+			json frame = json::parse(chunkString.c_str());
+			auto chunkRef = frame.find("chunk");
+			if(chunkRef == frame.end())
+			{
+				// anything else is the end of the upload
+				finished = true;
+				return false;
+			}
+			chunk = std::move(*chunkRef);
+			return true;
+		}
+		catch(...)
+		{
+			good = false;
+			return false;
+		}
+	}
+
+	// Sends the heartbeats that are due. Calls take themselves off the list before they answer, so a heartbeat
+	//    never goes out in the middle of a response.
+	void Listener::HelperHeartbeatThread(void)
+	{
+		std::unique_lock<std::mutex> guard(heartbeatLock);
+		while(!heartbeatStop)
+		{
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			std::chrono::steady_clock::time_point wake = std::chrono::steady_clock::time_point::max();
+			for(auto &beat : heartbeats)
+			{
+				if(beat.next <= now)
+				{
+					// a requester that can't be reached gets no more, its call finds out when it answers
+					if(SendString(*beat.connection, serializeFunction, "{\"env\":1,\"beat\":true}") == ErrorResult::Call_Ok)
+						beat.next = now + beat.interval;
+					else
+						beat.next = std::chrono::steady_clock::time_point::max();
+				}
+				wake = std::min(wake, beat.next);
+			}
+			if(wake == std::chrono::steady_clock::time_point::max())
+				heartbeatSignal.wait(guard);
+			else
+				heartbeatSignal.wait_until(guard, wake);
+		}
+	}
+
+	void Listener::HelperWorkThread(std::unique_ptr<ConnectionBase> connection)
+	{
+		try
+		{
+			HelperWork(connection);
+			connection->Stop();
+		}
+		catch(...){}
+		HelperThreadExit(false);
+	}
+}
+
+
+
+// helper functions for Request
+namespace
+{
+	// responses to cacheable functions shared by all requests, keyed by endpoint, name and args
+	struct SharedCache
+	{
+		netfunc::ResponseCache responses;
+		std::mutex lock;
+		// listener id and the last invalidation seen from each endpoint
+		std::map<std::string, std::pair<uint64_t, uint64_t>> endpoints;
+	};
+
+	SharedCache &GetSharedCache(void)
+	{
+		static SharedCache cache;
+		return cache;
+	}
+
+	netfunc::ErrorResult HelperReadResponse(std::unique_ptr<char[]> const &buffer, uint16_t sizeBytes,
+		netfunc::StringDeserializationType deserializeFunction, netfunc::json &response, bool *outHeartbeat = nullptr)
+	{
+		// pass buffer to deserializer, the string keeps its capacity for the next request on this thread
+		static thread_local std::string returnString;
+		if(!deserializeFunction(buffer, sizeBytes, returnString))
+			return netfunc::ErrorResult::Return_Error;
+
+		// get string as json
+		try
+		{
+			response = netfunc::json::parse(returnString.c_str());
+		}
+		catch(...)
+		{
+			return netfunc::ErrorResult::Return_Error;
+		}
+
+		// a listener that doesn't know the envelope sends the bare result
+		if(!response.is_object() || response.find("env") == response.end())
+		{
+			netfunc::json result = std::move(response);
+			response = netfunc::json::object();
+			response["result"] = std::move(result);
+			return netfunc::ErrorResult::Call_Ok;
+		}
+
+		if(outHeartbeat && response.find("beat") != response.end() && response.find("result") == response.end())
+		{
+			*outHeartbeat = true;
+			return netfunc::ErrorResult::Call_Ok;
+		}
+		if(response.find("result") == response.end())
+			return netfunc::ErrorResult::Return_Error;
+		return netfunc::ErrorResult::Call_Ok;
+	}
+
+	// Drops cached responses the listener says are no longer valid, then keeps this one if it has a ttl.
+	void HelperUpdateCache(std::string const &endpointKey, std::string const &cacheKey, netfunc::json const &response,
+		char const *data, uint16_t sizeBytes)
+	{
+		auto idRef = response.find("id");
+		auto seqRef = response.find("seq");
+		if(idRef == response.end() || seqRef == response.end() || !idRef->is_number() || !seqRef->is_number())
+			return;
+		uint64_t id = *idRef;
+		uint64_t seq = *seqRef;
+
+		SharedCache &cache = GetSharedCache();
+		std::lock_guard<std::mutex> guard(cache.lock);
+		auto known = cache.endpoints.find(endpointKey);
+		if(known == cache.endpoints.end() || known->second.first != id)
+		{
+			// new or restarted listener, nothing from before can be trusted
+			cache.responses.ErasePrefix(endpointKey);
+			cache.endpoints[endpointKey] = std::make_pair(id, seq);
+			known = cache.endpoints.find(endpointKey);
+		}
+		else
+		{
+			auto invRef = response.find("inv");
+			if(invRef != response.end())
+			{
+				if(invRef->is_array())
+				{
+					for(auto const &name : *invRef)
+						if(name.is_string())
+							cache.responses.ErasePrefix(endpointKey + name.get<std::string>() + '\0');
+				}
+				else
+					cache.responses.ErasePrefix(endpointKey);
+			}
+			if(seq > known->second.second)
+				known->second.second = seq;
+		}
+
+		// a response older than invalidations we already know about might be stale
+		auto ttlRef = response.find("ttl");
+		if(ttlRef == response.end() || !ttlRef->is_number() || seq < known->second.second)
+			return;
+		float ttlSeconds = *ttlRef;
+		if(ttlSeconds <= 0.0f)
+			return;
+
+		std::shared_ptr<netfunc::ResponseCache::Entry> entry(new netfunc::ResponseCache::Entry());
+		entry->buffer = netfunc::BufferPool::Acquire(sizeBytes);
+		std::memcpy(entry->buffer.get(), data, sizeBytes);
+		entry->sizeBytes = sizeBytes;
+		entry->expires = true;
+		entry->expireTime = std::chrono::steady_clock::now() + 
+			std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(ttlSeconds));
+		cache.responses.Insert(cacheKey, std::move(entry));
+	}
+
+	// Connects to the listener and sends the request.
+	// attachments : if not null and not empty, sent in their own message after the request
+	// timeoutSeconds : how long the connect may take, on return what is left of it
+	netfunc::ErrorResult HelperOpen(std::string const &address, uint16_t port, netfunc::json &fullRequest,
+		float &timeoutSeconds, std::unique_ptr<netfunc::ConnectionBase> &connection,
+		netfunc::StringSerializationType serializeFunction, netfunc::Attachments const *attachments = nullptr,
+		std::atomic_bool const *running = nullptr)
+	{
+		// asks for the response with its fields around the result, older listeners ignore it and send the bare result
+		fullRequest["env"] = 1;
+		bool hasAttachments = attachments && attachments->Count() != 0;
+		if(hasAttachments)
+			fullRequest["att"] = attachments->Describe();
+
+		// create the json as a string
+		std::string requestString;
+		try
+		{
+			requestString = fullRequest.dump();
+		}
+		catch(...)
+		{
+			return netfunc::ErrorResult::Bad_Json;
+		}
+
+		// pass the string through the serializer
+		std::unique_ptr<char[]> buffer;
+		uint16_t sizeBytes = 0;
+		if(!serializeFunction(requestString, buffer, sizeBytes))
+			return netfunc::ErrorResult::Bad_String;
+
+		// start the connection
+		if(!connection->Setup(0))
+		{
+			ReleaseSerialized(serializeFunction, buffer, sizeBytes);
+			return netfunc::ErrorResult::Net_Error;
+		}
+		auto connectStart = std::chrono::steady_clock::now();
+		netfunc::ErrorResult connected = connection->ConnectWithin(address, port, timeoutSeconds);
+		if(connected != netfunc::ErrorResult::Call_Ok)
+		{
+			ReleaseSerialized(serializeFunction, buffer, sizeBytes);
+			connection->Stop();
+			return connected;
+		}
+
+		// a call cancelled while connecting never reaches the listener
+		if(running && !*running)
+		{
+			ReleaseSerialized(serializeFunction, buffer, sizeBytes);
+			connection->Stop();
+			return netfunc::ErrorResult::Request_Timeout;
+		}
+		timeoutSeconds = std::max(0.0f, timeoutSeconds - 
+			std::chrono::duration<float>(std::chrono::steady_clock::now() - connectStart).count());
+
+		// send the string
+		netfunc::SendSpan part = { buffer.get(), sizeBytes };
+		bool sent = connection->SendParts(&part, 1);
+		ReleaseSerialized(serializeFunction, buffer, sizeBytes);
+		if(sent && hasAttachments)
+		{
+			std::vector<netfunc::SendSpan> spans;
+			attachments->Spans(spans);
+			sent = connection->SendParts(spans.data(), uint32_t(spans.size()));
+		}
+		if(!sent)
+		{
+			connection->Stop();
+			return netfunc::ErrorResult::Net_Error;
+		}
+		return netfunc::ErrorResult::Call_Ok;
+	}
+
+	// Waits for the next message from the listener, the connection is stopped if this fails.
+	// running : if not null, the wait gives up once it is cleared
+	netfunc::ErrorResult HelperWaitMessage(std::unique_ptr<netfunc::ConnectionBase> &connection, PooledBuffer &received,
+		uint16_t &sizeBytes, float timeoutSeconds, std::atomic_bool const *running = nullptr)
 	{
-		if(running)
-			return ErrorResult::Listener_Started;
-		
-		// setup variables
-		if(listeningConnection == nullptr)
-#if defined(__GNUC__)
-			listeningConnection.reset(new DefaultConnection());
-#else
-			return ErrorResult::No_Default;
-#endif
+		netfunc::ErrorResult error = RecvMessage(*connection, received, sizeBytes, timeoutSeconds, running);
+		if(error != netfunc::ErrorResult::Call_Ok)
+			connection->Stop();
+		return error;
+	}
 
-		if(serializeFunction == nullptr || deserializeFunction == nullptr)
+	// Waits for the response to a call, skipping the heartbeats the listener sends while the function runs.
+	//    Missed heartbeats only count once the first one has come in, a busy listener may take a while to
+	//    pick the call up, until then the timeout is all there is.
+	// heartbeatSeconds : the interval the listener was asked for, 0 if it wasn't
+	// return : Net_Error if the heartbeats stopped before the timeout ran out
+	netfunc::ErrorResult HelperWaitResponse(std::unique_ptr<netfunc::ConnectionBase> &connection, PooledBuffer &received,
+		uint16_t &sizeBytes, float timeoutSeconds, float heartbeatSeconds, netfunc::StringDeserializationType deserializeFunction,
+		netfunc::json &response, std::atomic_bool const *running)
+	{
+		std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+			std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(timeoutSeconds));
+		bool beating = false;
+		for(;;)
 		{
-			serializeFunction = DefaultStringSerialization;
-			deserializeFunction = DefaultStringDeserialization;
+			float remainingSeconds = std::max(0.0f, std::chrono::duration<float>(deadline - std::chrono::steady_clock::now()).count());
+			float waitSeconds = remainingSeconds;
+			if(heartbeatSeconds > 0.0f && beating)
+				waitSeconds = std::min(waitSeconds, heartbeatSeconds * missedHeartbeats);
+			netfunc::ErrorResult error = HelperWaitMessage(connection, received, sizeBytes, waitSeconds, running);
+			if(error == netfunc::ErrorResult::Request_Timeout && waitSeconds < remainingSeconds && (!running || *running))
+				return netfunc::ErrorResult::Net_Error;
+			if(error != netfunc::ErrorResult::Call_Ok)
+				return error;
+
+			bool heartbeat = false;
+			error = HelperReadResponse(received.buffer, sizeBytes, deserializeFunction, response, &heartbeat);
+			if(error != netfunc::ErrorResult::Call_Ok)
+			{
+				connection->Stop();
+				return error;
+			}
+			if(!heartbeat)
+				return netfunc::ErrorResult::Call_Ok;
+			beating = true;
 		}
-		
-		maxThreadCount = helperNum;
-		internalTimeout = timeoutSeconds;
+	}
 
-		// start the listener socket
-		if(!listeningConnection->Setup(port))
-			return ErrorResult::Net_Error;
-		if(!listeningConnection->Listen(acceptQueueSize))
+	// Circuit breakers for every listener called, shared by all requests.
+	struct CircuitBreakers
+	{
+		std::mutex lock;
+		netfunc::CircuitBreakerPolicy policy;
+		struct Breaker
 		{
-			listeningConnection->Stop();
-			return ErrorResult::Net_Error;
+			netfunc::EndpointStats stats;
+			bool probing;
+			std::chrono::steady_clock::time_point openUntil;
+		};
+		std::unordered_map<std::string, Breaker> breakers;
+	};
+	CircuitBreakers &GetCircuitBreakers(void)
+	{
+		static CircuitBreakers circuitBreakers;
+		return circuitBreakers;
+	}
+
+	// a network error or timeout says something about the listener, other errors are about the call
+	bool IsEndpointFailure(netfunc::ErrorResult result)
+	{
+		return result == netfunc::ErrorResult::Net_Error || result == netfunc::ErrorResult::Request_Timeout ||
+			result == netfunc::ErrorResult::Connect_Timeout || result == netfunc::ErrorResult::Invalid_Address;
+	}
+
+	// Asks the breaker of a listener whether a call can be made.
+	// return : false if the call should fail with Circuit_Open
+	bool BreakerAdmit(std::string const &address, uint16_t port)
+	{
+		CircuitBreakers &circuitBreakers = GetCircuitBreakers();
+		std::lock_guard<std::mutex> guard(circuitBreakers.lock);
+		if(circuitBreakers.policy.failureThreshold == 0)
+			return true;
+
+		std::string key = address + '\0' + std::to_string(port);
+		auto found = circuitBreakers.breakers.find(key);
+		if(found == circuitBreakers.breakers.end())
+		{
+			CircuitBreakers::Breaker breaker;
+			breaker.stats = { address, port, netfunc::CircuitState::Closed, 0, 0, 0, 0 };
+			breaker.probing = false;
+			found = circuitBreakers.breakers.emplace(key, breaker).first;
 		}
-		
-		running = true;
-		
-		// start a helper thread if helperNum is greater than 0
-		if(maxThreadCount >= 1)
+
+		CircuitBreakers::Breaker &breaker = found->second;
+		if(breaker.stats.state == netfunc::CircuitState::Open && breaker.openUntil <= std::chrono::steady_clock::now())
+			breaker.stats.state = netfunc::CircuitState::HalfOpen;
+		if(breaker.stats.state == netfunc::CircuitState::Closed)
+			return true;
+		if(breaker.stats.state == netfunc::CircuitState::HalfOpen && !breaker.probing)
 		{
-			++activeThreadCount;
-			std::thread t(&Listener::HelperUpdateThread, this);
-			t.detach();
-			threadedError = ErrorResult::Call_Ok;
+			breaker.probing = true;
+			return true;
 		}
-		
-		return ErrorResult::Call_Ok;
+		++breaker.stats.rejected;
+		return false;
 	}
-	
-	// Stops the listener port and waits for all threads to finish.
-	void Listener::Stop(void)
+
+	// Tells the breaker of a listener how an admitted call went.
+	// cancelled : the call was stopped by Cancel, it says nothing about the listener
+	void BreakerReport(std::string const &address, uint16_t port, netfunc::ErrorResult result, bool cancelled)
 	{
-		if(running)
+		CircuitBreakers &circuitBreakers = GetCircuitBreakers();
+		std::lock_guard<std::mutex> guard(circuitBreakers.lock);
+		auto found = circuitBreakers.breakers.find(address + '\0' + std::to_string(port));
+		if(found == circuitBreakers.breakers.end())
+			return;
+
+		CircuitBreakers::Breaker &breaker = found->second;
+		bool wasProbe = breaker.stats.state == netfunc::CircuitState::HalfOpen && breaker.probing;
+		if(wasProbe)
+			breaker.probing = false;
+		if(cancelled)
+			return;
+
+		if(!IsEndpointFailure(result))
 		{
-			running = false;
-			
-			// wait for threads
-			while(activeThreadCount > 0)
-				std::this_thread::sleep_for(std::chrono::milliseconds(50));
-			
-			listeningConnection->Stop();
+			++breaker.stats.successes;
+			breaker.stats.consecutiveFailures = 0;
+			breaker.stats.state = netfunc::CircuitState::Closed;
+			return;
+		}
+
+		++breaker.stats.failures;
+		++breaker.stats.consecutiveFailures;
+		if(wasProbe || (breaker.stats.state == netfunc::CircuitState::Closed &&
+			breaker.stats.consecutiveFailures >= circuitBreakers.policy.failureThreshold))
+		{
+			breaker.stats.state = netfunc::CircuitState::Open;
+			breaker.openUntil = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+				std::chrono::duration<float>(circuitBreakers.policy.openSeconds));
 		}
 	}
-	
-	// Trys to accept and process requests.
-	// timeoutSeconds : the amount of time that should pass before the function stops accepting new requests and return
-	ErrorResult Listener::Update(float timeoutSeconds)
+
+	netfunc::ErrorResult HelperRequest(std::string const &address, uint16_t port, std::string const &name, 
+		netfunc::json const &args, netfunc::json &result, float timeoutSeconds, float heartbeatSeconds,
+		std::unique_ptr<netfunc::ConnectionBase> &connection, 
+		netfunc::StringSerializationType serializeFunction, netfunc::StringDeserializationType deserializeFunction,
+		bool useCache, netfunc::Attachments const &argAttachments, netfunc::Attachments &resultAttachments,
+		std::atomic_bool const *running, std::string const &idempotencyKey, bool &outAdmitted)
 	{
-		try
+		outAdmitted = false;
+		netfunc::json fullRequest;
+		fullRequest.emplace("name", name);
+		fullRequest.emplace("args", args);
+		if(!idempotencyKey.empty())
+			fullRequest.emplace("key", idempotencyKey);
+		if(heartbeatSeconds > 0.0f)
 		{
-			if(running)
+			heartbeatSeconds = std::max(heartbeatSeconds, minHeartbeatSeconds);
+			fullRequest.emplace("beat", heartbeatSeconds);
+		}
+
+		// the cache key doesn't cover attachments
+		resultAttachments.Clear();
+		if(argAttachments.Count() != 0)
+			useCache = false;
+
+		// try the shared cache before going to the network
+		std::string endpointKey;
+		std::string cacheKey;
+		if(useCache)
+		{
+			endpointKey = address + '\0' + std::to_string(port) + '\0';
+			cacheKey = endpointKey + name + '\0' + args.dump();
+
+			SharedCache &cache = GetSharedCache();
+			std::shared_ptr<netfunc::ResponseCache::Entry const> cached = cache.responses.Find(cacheKey);
+			if(cached)
 			{
-				if(maxThreadCount == 0)
-					return HelperUpdate(timeoutSeconds);
-				else
-					return threadedError;
+				netfunc::json response;
+				netfunc::ErrorResult error = HelperReadResponse(cached->buffer, cached->sizeBytes, deserializeFunction, response);
+				if(error == netfunc::ErrorResult::Call_Ok)
+					result = std::move(response["result"]);
+				return error;
 			}
+
+			// let the listener know which invalidations we have already seen
+			std::lock_guard<std::mutex> guard(cache.lock);
+			auto known = cache.endpoints.find(endpointKey);
+			if(known != cache.endpoints.end())
+				fullRequest.emplace("cache", netfunc::json::array({ known->second.first, known->second.second }));
 			else
-				return ErrorResult::Net_Error;
+				fullRequest.emplace("cache", nullptr);
 		}
-		catch(...)
+
+		// past the cache the call goes to the network, unless the listener's circuit is open
+		if(!BreakerAdmit(address, port))
+			return netfunc::ErrorResult::Circuit_Open;
+		outAdmitted = true;
+
+		// the connect and the response share the timeout
+		netfunc::ErrorResult error = HelperOpen(address, port, fullRequest, timeoutSeconds, connection, serializeFunction, &argAttachments, running);
+		if(error != netfunc::ErrorResult::Call_Ok)
+			return error;
+
+		// wait for response
+		PooledBuffer received(netfunc::maxMessageBytes);
+		uint16_t sizeBytes = 0;
+		netfunc::json response;
+		error = HelperWaitResponse(connection, received, sizeBytes, timeoutSeconds, heartbeatSeconds, deserializeFunction,
+			response, running);
+		if(error != netfunc::ErrorResult::Call_Ok)
+			return error;
+
+		// attachments follow in their own message
+		auto attRef = response.find("att");
+		if(attRef != response.end())
 		{
-			return ErrorResult::Net_Error;
+			PooledBuffer attachmentReceived(netfunc::maxMessageBytes);
+			uint16_t attachmentBytes = 0;
+			error = HelperWaitMessage(connection, attachmentReceived, attachmentBytes, timeoutSeconds, running);
+			if(error != netfunc::ErrorResult::Call_Ok)
+				return error;
+			if(!resultAttachments.Receive(attachmentReceived.buffer, attachmentBytes, *attRef))
+			{
+				connection->Stop();
+				return netfunc::ErrorResult::Return_Error;
+			}
+			useCache = false;
 		}
+
+		// close connection
+		connection->Stop();
+
+		if(useCache)
+			HelperUpdateCache(endpointKey, cacheKey, response, received.buffer.get(), sizeBytes);
+
+		result = std::move(response["result"]);
+		return netfunc::ErrorResult::Call_Ok;
 	}
-	
-	ErrorResult Listener::HelperUpdate(float timeoutSeconds)
+
+	netfunc::ErrorResult HelperRequestStream(std::string const &address, uint16_t port, std::string const &name, 
+		netfunc::json const &args, netfunc::json &result, std::function<bool(netfunc::json const &chunk)> const &onChunk,
+		float timeoutSeconds, uint32_t window, std::unique_ptr<netfunc::ConnectionBase> &connection, 
+		netfunc::StringSerializationType serializeFunction, netfunc::StringDeserializationType deserializeFunction,
+		std::atomic_bool const *running)
 	{
-		std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+		if(window == 0)
+			window = 1;
+
+		netfunc::json fullRequest;
+		fullRequest.emplace("name", name);
+		fullRequest.emplace("args", args);
+		fullRequest.emplace("stream", window);
+
+		// the connect shares the timeout with the first chunk
+		float waitSeconds = timeoutSeconds;
+		netfunc::ErrorResult error = HelperOpen(address, port, fullRequest, waitSeconds, connection, serializeFunction, nullptr, running);
+		if(error != netfunc::ErrorResult::Call_Ok)
+			return error;
+
+		// read chunks until the final result shows up
+		PooledBuffer received(netfunc::maxMessageBytes);
+		uint32_t consumed = 0;
 		for(;;)
 		{
-			// check for timeout
-			std::chrono::steady_clock::time_point nowTime = std::chrono::steady_clock::now();
-			if(std::chrono::duration_cast<std::chrono::duration<double>>(nowTime-startTime).count() > timeoutSeconds)
+			uint16_t sizeBytes = 0;
+			error = HelperWaitMessage(connection, received, sizeBytes, waitSeconds, running);
+			if(error != netfunc::ErrorResult::Call_Ok)
+				return error;
+			waitSeconds = timeoutSeconds;
+
+			std::string frameString;
+			if(!deserializeFunction(received.buffer, sizeBytes, frameString))
 			{
-				return ErrorResult::Call_Ok;
+				connection->Stop();
+				return netfunc::ErrorResult::Return_Error;
 			}
-			
-			// try to get a connection
-			std::unique_ptr<ConnectionBase> newConnection;
-			if(!listeningConnection->Accept(newConnection))
-				return ErrorResult::Net_Error;
-			
-			if(newConnection)
+			netfunc::json frame;
+			try
 			{
-				// make new thread for request if can, otherwise run in this thread
-				if(activeThreadCount < maxThreadCount)
+				frame = netfunc::json::parse(frameString.c_str());
+			}
+			catch(...)
+			{
+				connection->Stop();
+				return netfunc::ErrorResult::Return_Error;
+			}
+
+			auto chunkRef = frame.find("chunk");
+			if(chunkRef == frame.end())
+			{
+				connection->Stop();
+				if(frame.find("env") == frame.end())
 				{
-					++activeThreadCount;
-					std::thread t(&Listener::HelperWorkThread, this, std::move(newConnection));
-					t.detach();
+					// a listener that doesn't know the envelope sends the bare result
+					result = std::move(frame);
+					return netfunc::ErrorResult::Call_Ok;
 				}
-				else
+				auto resultRef = frame.find("result");
+				if(resultRef == frame.end())
+					return netfunc::ErrorResult::Return_Error;
+				result = std::move(*resultRef);
+				return netfunc::ErrorResult::Call_Ok;
+			}
+
+			// closing the connection is how the listener learns the stream was stopped
+			if(!onChunk(*chunkRef))
+			{
+				connection->Stop();
+				return netfunc::ErrorResult::Call_Ok;
+			}
+
+			// give the window back in batches so there is one small message per several chunks
+			if(++consumed >= (window + 1) / 2)
+			{
+				netfunc::json credit;
+				credit.emplace("credit", consumed);
+				error = SendString(*connection, serializeFunction, credit.dump());
+				if(error != netfunc::ErrorResult::Call_Ok)
 				{
-					ErrorResult result = HelperWork(newConnection);
-					newConnection->Stop();
-					if(result != ErrorResult::Call_Ok)
-						return result;
+					connection->Stop();
+					return error;
 				}
+				consumed = 0;
 			}
-			
-			std::this_thread::sleep_for(std::chrono::milliseconds(1));
 		}
 	}
-	
-	void Listener::HelperUpdateThread(void)
+
+	netfunc::ErrorResult HelperRequestFile(std::string const &address, uint16_t port, std::string const &name, 
+		netfunc::json const &args, netfunc::json &result, std::function<bool(char const *data, size_t sizeBytes)> const &onData,
+		float timeoutSeconds, float heartbeatSeconds, std::unique_ptr<netfunc::ConnectionBase> &connection, 
+		netfunc::StringSerializationType serializeFunction, netfunc::StringDeserializationType deserializeFunction,
+		std::atomic_bool const *running)
+	{
+		netfunc::json fullRequest;
+		fullRequest.emplace("name", name);
+		fullRequest.emplace("args", args);
+		if(heartbeatSeconds > 0.0f)
+		{
+			heartbeatSeconds = std::max(heartbeatSeconds, minHeartbeatSeconds);
+			fullRequest.emplace("beat", heartbeatSeconds);
+		}
+
+		// the connect shares the timeout with the result
+		float waitSeconds = timeoutSeconds;
+		netfunc::ErrorResult error = HelperOpen(address, port, fullRequest, waitSeconds, connection, serializeFunction, nullptr, running);
+		if(error != netfunc::ErrorResult::Call_Ok)
+			return error;
+
+		PooledBuffer received(netfunc::maxMessageBytes);
+		uint16_t sizeBytes = 0;
+		netfunc::json response;
+		error = HelperWaitResponse(connection, received, sizeBytes, waitSeconds, heartbeatSeconds, deserializeFunction,
+			response, running);
+		if(error != netfunc::ErrorResult::Call_Ok)
+			return error;
+		result = std::move(response["result"]);
+
+		// a function that didn't name a file sends nothing else
+		uint64_t remainingBytes = 0;
+		auto fileRef = response.find("file");
+		if(fileRef != response.end() && fileRef->is_number_unsigned())
+			remainingBytes = fileRef->get<uint64_t>();
+
+		// the file follows in pieces, closing the connection is how the listener learns to stop sending it
+		while(remainingBytes > 0)
+		{
+			error = HelperWaitMessage(connection, received, sizeBytes, timeoutSeconds, running);
+			if(error != netfunc::ErrorResult::Call_Ok)
+				return error;
+			if(sizeBytes > remainingBytes)
+			{
+				connection->Stop();
+				return netfunc::ErrorResult::Return_Error;
+			}
+			remainingBytes -= sizeBytes;
+			if(!onData(received.buffer.get(), sizeBytes))
+				break;
+		}
+
+		connection->Stop();
+		return netfunc::ErrorResult::Call_Ok;
+	}
+
+	// Retries are paid for from one budget for the whole process.
+	struct RetryBudget
+	{
+		std::mutex lock;
+		double tokens = 10.0;
+	};
+	RetryBudget &GetRetryBudget(void)
+	{
+		static RetryBudget budget;
+		return budget;
+	}
+
+	// most retries that can be saved up for a burst of failures
+	const double maxRetryTokens = 10.0;
+
+	// HelperRequest, made again under the retry policy with the same idempotency key each time.
+	netfunc::ErrorResult HelperRequestRetry(std::string const &address, uint16_t port, std::string const &name, 
+		netfunc::json const &args, netfunc::json &result, float timeoutSeconds, float heartbeatSeconds,
+		std::unique_ptr<netfunc::ConnectionBase> &connection, 
+		netfunc::StringSerializationType serializeFunction, netfunc::StringDeserializationType deserializeFunction,
+		bool useCache, netfunc::Attachments const &argAttachments, netfunc::Attachments &resultAttachments,
+		std::atomic_bool const *running, netfunc::RetryPolicy const &policy)
+	{
+		static thread_local std::mt19937_64 random(std::random_device{}());
+		std::string idempotencyKey;
+		if(policy.maxAttempts > 1)
+		{
+			char keyText[17];
+			std::snprintf(keyText, sizeof(keyText), "%016llx", static_cast<unsigned long long>(random()));
+			idempotencyKey = keyText;
+		}
+		{
+			RetryBudget &budget = GetRetryBudget();
+			std::lock_guard<std::mutex> guard(budget.lock);
+			budget.tokens = std::min(maxRetryTokens, budget.tokens + policy.budgetFraction);
+		}
+
+		for(uint32_t attempt = 1;; ++attempt)
+		{
+			bool admitted = false;
+			netfunc::ErrorResult error = HelperRequest(address, port, name, args, result, timeoutSeconds, heartbeatSeconds, connection,
+				serializeFunction, deserializeFunction, useCache, argAttachments, resultAttachments, running, idempotencyKey,
+				admitted);
+			if(admitted)
+				BreakerReport(address, port, error, running && !*running);
+			if(!IsEndpointFailure(error) || attempt >= policy.maxAttempts || (running && !*running))
+				return error;
+
+			{
+				RetryBudget &budget = GetRetryBudget();
+				std::lock_guard<std::mutex> guard(budget.lock);
+				if(budget.tokens < 1.0)
+					return error;
+				budget.tokens -= 1.0;
+			}
+
+			// full jitter, so retries from many requesters that failed together don't arrive together
+			double limit = std::min<double>(policy.maxBackoffSeconds, policy.baseBackoffSeconds * double(1u << std::min(attempt - 1, 20u)));
+			std::uniform_real_distribution<double> backoff(0.0, limit);
+			std::this_thread::sleep_for(std::chrono::duration<double>(backoff(random)));
+			if(running && !*running)
+				return error;
+		}
+	}
+
+	// A call cancelled before it started still stops early, the flag is set again once the call is over.
+	class RunningScope
+	{
+		std::atomic_bool &running;
+	public:
+		RunningScope(std::atomic_bool &runningIn) : running(runningIn) {}
+		~RunningScope() { running = true; }
+		RunningScope(RunningScope&) = delete;
+		void operator=(RunningScope&) = delete;
+	};
+
+	void HelperRequestThread(std::string address, uint16_t port, std::string name, netfunc::json args,
+		float timeoutSeconds, std::unique_ptr<netfunc::ConnectionBase> connection, 
+		netfunc::StringSerializationType serializeFunction, netfunc::StringDeserializationType deserializeFunction,
+		bool useCache, netfunc::Attachments argAttachments, netfunc::RetryPolicy policy)
+	{
+		netfunc::json result;
+		netfunc::Attachments resultAttachments;
+		try
+		{
+			HelperRequestRetry(address, port, name, args, result, timeoutSeconds, 0.0f,
+				connection, serializeFunction, deserializeFunction, useCache, argAttachments, resultAttachments, nullptr, policy);
+		}
+		catch(...){}
+	}
+}
+
+// definition for Request
+namespace netfunc
+{
+	// Send a request to execute a function on a listening connection.
+	// address, port : location to try to connect to
+	// name : the name bound to the function on the listening connection
+	// args : the arguments that are passed to the function
+	// waitForResult : should the function block until the remote function has finished
+	//    if true, function will block
+	//    if false, function will spawn a detached thread that handles the function call. there will not be a result.
+	// timeoutSeconds : this is the maximum amount of time that the function can take to execute
+	ErrorResult Request::Send(std::string const &address, uint16_t port, std::string const &name, json const &args, 
+		bool waitForResult, float timeoutSeconds)
+	{
+		try
+		{
+			ErrorResult error = HelperDefaults();
+			if(error != ErrorResult::Call_Ok)
+				return error;
+
+			if (waitForResult)
+			{
+				// do things in this thread
+				RunningScope scope(*running);
+				return HelperRequestRetry(address, port, name, args, result, timeoutSeconds, heartbeatSeconds,
+					connection, serializeFunction, deserializeFunction, useCache, argAttachments, resultAttachments, running.get(),
+					retryPolicy);
+			}
+			else
+			{
+				// spawn helper thread, with its own copy of the attachments since they may be views
+				Attachments attachmentsCopy;
+				for(size_t i = 0; i < argAttachments.Count(); ++i)
+					attachmentsCopy.Add(argAttachments.Name(i), argAttachments.Data(i), argAttachments.SizeBytes(i));
+				std::thread t(HelperRequestThread, address, port, name, args, timeoutSeconds, std::move(connection), 
+					serializeFunction, deserializeFunction, useCache, std::move(attachmentsCopy), retryPolicy);
+				t.detach();
+				return ErrorResult::Call_Ok;
+			}
+		}
+		catch(...)
+		{
+			return ErrorResult::Net_Error;
+		}
+	}
+
+	// Send a request to a streaming function on a listening connection and block while its chunks arrive.
+	//    Once the function is done its result is in result.
+	// address, port : location to try to connect to
+	// name : the name bound to the function on the listening connection
+	// args : the arguments that are passed to the function
+	// onChunk : called with each chunk in order, return false to stop the stream
+	// timeoutSeconds : the maximum amount of time to wait for the next chunk
+	// window : how many chunks the function can send before it has to wait for onChunk to catch up
+	ErrorResult Request::SendStream(std::string const &address, uint16_t port, std::string const &name, json const &args,
+		std::function<bool(json const &chunk)> const &onChunk, float timeoutSeconds, uint32_t window)
+	{
+		try
+		{
+			ErrorResult error = HelperDefaults();
+			if(error != ErrorResult::Call_Ok)
+				return error;
+
+			if(!BreakerAdmit(address, port))
+				return ErrorResult::Circuit_Open;
+			RunningScope scope(*running);
+			error = HelperRequestStream(address, port, name, args, result, onChunk, timeoutSeconds, window,
+				connection, serializeFunction, deserializeFunction, running.get());
+			BreakerReport(address, port, error, !*running);
+			return error;
+		}
+		catch(...)
+		{
+			return ErrorResult::Net_Error;
+		}
+	}
+
+	// Send a request to a file function on a listening connection and block while the file arrives.
+	//    Once it has all arrived the function's result is in result.
+	// address, port : location to try to connect to
+	// name : the name bound to the function on the listening connection
+	// args : the arguments that are passed to the function
+	// onData : called with each piece of the file in order, return false to stop receiving it
+	// timeoutSeconds : the maximum amount of time to wait for the result or the next piece
+	ErrorResult Request::SendForFile(std::string const &address, uint16_t port, std::string const &name, json const &args,
+		std::function<bool(char const *data, size_t sizeBytes)> const &onData, float timeoutSeconds)
 	{
 		try
 		{
-			while(running)
-			{
-				if(HelperUpdate(5) == ErrorResult::Net_Error)
-				{
-					threadedError = ErrorResult::Net_Error;
-					break;
-				}
-			}
+			ErrorResult error = HelperDefaults();
+			if(error != ErrorResult::Call_Ok)
+				return error;
+
+			if(!BreakerAdmit(address, port))
+				return ErrorResult::Circuit_Open;
+			RunningScope scope(*running);
+			error = HelperRequestFile(address, port, name, args, result, onData, timeoutSeconds, heartbeatSeconds,
+				connection, serializeFunction, deserializeFunction, running.get());
+			BreakerReport(address, port, error, !*running);
+			return error;
+		}
+		catch(...)
+		{
+			return ErrorResult::Net_Error;
 		}
-		catch(...){}
-		--activeThreadCount;
 	}
-	
-	ErrorResult Listener::HelperWork(std::unique_ptr<ConnectionBase> &connection)
-	{
-		ErrorResult returnValue = ErrorResult::Call_Ok;
 
-		// read the request
-		std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
-		std::unique_ptr<char[]> buffer;
-		uint16_t sizeBytes = 0;
-		for(;;)
+	// Open a call to an upload function on a listening connection. The function starts right away, the rest
+	//    of its args are sent with WriteChunk and the result is collected with FinishUpload.
+	// address, port : location to try to connect to
+	// name : the name bound to the function on the listening connection
+	// args : the arguments that are passed to the function when it starts
+	// timeoutSeconds : the maximum amount of time to wait for the connection
+	ErrorResult Request::OpenUpload(std::string const &address, uint16_t port, std::string const &name, json const &args,
+		float timeoutSeconds)
+	{
+		try
 		{
-			// check for timeout
-			std::chrono::steady_clock::time_point nowTime = std::chrono::steady_clock::now();
-			if(std::chrono::duration_cast<std::chrono::duration<double>>(nowTime-startTime).count() > internalTimeout)
-				return netfunc::ErrorResult::Request_Timeout;
+			if(uploadOpen)
+			{
+				connection->Stop();
+				uploadOpen = false;
+			}
 
-			// get data
-			if(!connection->Recv(buffer, sizeBytes))
-				return netfunc::ErrorResult::Net_Error;
-			if(buffer)
-				break;
+			ErrorResult error = HelperDefaults();
+			if(error != ErrorResult::Call_Ok)
+				return error;
 
-			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			json fullRequest;
+			fullRequest.emplace("name", name);
+			fullRequest.emplace("args", args);
+			fullRequest.emplace("upload", true);
+			error = HelperOpen(address, port, fullRequest, timeoutSeconds, connection, serializeFunction);
+			uploadOpen = error == ErrorResult::Call_Ok;
+			return error;
+		}
+		catch(...)
+		{
+			return ErrorResult::Net_Error;
 		}
+	}
 
-		// pass buffer to deserializer
-		std::string jsonString;
-		if(!deserializeFunction(buffer, sizeBytes, jsonString))
-			return netfunc::ErrorResult::Bad_String;
-		buffer.reset();
-		sizeBytes = 0;
+	// Send the next chunk of args to the upload function opened with OpenUpload.
+	//    This blocks while the function is too far behind reading the chunks.
+	ErrorResult Request::WriteChunk(json const &chunk)
+	{
+		if(!uploadOpen)
+			return ErrorResult::Net_Error;
 
-		// deserialize json
-		nlohmann::json request;
 		try
 		{
-			request = nlohmann::json::parse(jsonString.c_str());
+			// a failed send leaves the call in an unknown state, so it is closed
+			ErrorResult error = SendString(*connection, serializeFunction, "{\"chunk\":" + chunk.dump() + "}");
+			if(error == ErrorResult::Net_Error)
+			{
+				connection->Stop();
+				uploadOpen = false;
+			}
+			return error;
 		}
 		catch(...)
 		{
-			return netfunc::ErrorResult::Bad_String;
+			return ErrorResult::Bad_Json;
 		}
+	}
 
-		// call function
-		nlohmann::json result;
-		{
-			auto nameRef = request.find("name");
-			auto argsRef = request.find("args");
-			if(nameRef == request.end() || argsRef == request.end())
-				return ErrorResult::Bad_Json;
+	// Tell the upload function that all the chunks have been sent and wait for it to finish.
+	// timeoutSeconds : the maximum amount of time to wait for the result
+	ErrorResult Request::FinishUpload(float timeoutSeconds)
+	{
+		if(!uploadOpen)
+			return ErrorResult::Net_Error;
+		uploadOpen = false;
 
-			// look for function, call if found
-			auto foundFunc = functions.find(*nameRef);
-			if(foundFunc != functions.end())
-				foundFunc->second(*argsRef, result);
-			else
+		try
+		{
+			ErrorResult error = SendString(*connection, serializeFunction, "{\"end\":true}");
+			if(error != ErrorResult::Call_Ok)
 			{
-				// if not found, try default. no default, were done here
-				if(defaultFunction)
-					defaultFunction(*argsRef, result);
-				else
-					return ErrorResult::Call_Ok;
+				connection->Stop();
+				return error;
 			}
-		}
 
-		// serialize result
-		try
-		{
-			jsonString = result.dump();
+			PooledBuffer received(maxMessageBytes);
+			uint16_t sizeBytes = 0;
+			error = HelperWaitMessage(connection, received, sizeBytes, timeoutSeconds);
+			if(error != ErrorResult::Call_Ok)
+				return error;
+			connection->Stop();
+
+			json response;
+			error = HelperReadResponse(received.buffer, sizeBytes, deserializeFunction, response);
+			if(error != ErrorResult::Call_Ok)
+				return error;
+			result = std::move(response["result"]);
+			return ErrorResult::Call_Ok;
 		}
 		catch(...)
 		{
-			// if failed, send back an empty object instead
-			jsonString = "{}";
-			returnValue = ErrorResult::Return_Error;
+			connection->Stop();
+			return ErrorResult::Net_Error;
 		}
+	}
+
+	ErrorResult Request::HelperDefaults(void)
+	{
+		if(connection == nullptr)
+#if defined(__GNUC__)
+			connection.reset(new DefaultConnection());
+#else
+			return ErrorResult::No_Default;
+#endif
+		connection->SetOptions(socketOptions);
 
-		if(!serializeFunction(jsonString, buffer, sizeBytes))
+		if(serializeFunction == nullptr || deserializeFunction == nullptr)
 		{
-			// if failed, return something
-			buffer.reset(new char[1]);
-			*buffer.get() = 0;
-			sizeBytes = 1;
-			returnValue = ErrorResult::Return_Error;
+			serializeFunction = DefaultStringSerialization;
+			deserializeFunction = DefaultStringDeserialization;
 		}
+		return ErrorResult::Call_Ok;
+	}
 
-		// send result
-		if(!connection->Send(buffer, sizeBytes))
-			return netfunc::ErrorResult::Net_Error;
+	// Opens a connection to a listener and closes it again without sending a call.
+	ErrorResult Request::HelperProbe(std::string const &address, uint16_t port, float timeoutSeconds)
+	{
+		ErrorResult error = HelperDefaults();
+		if(error != ErrorResult::Call_Ok)
+			return error;
+		if(!connection->Setup(0))
+			return ErrorResult::Net_Error;
+		error = connection->ConnectWithin(address, port, timeoutSeconds);
+		connection->Stop();
+		return error;
+	}
 
-		// wait for a half a second to let network do its thing
-		std::this_thread::sleep_for(std::chrono::milliseconds(500));
-		
-		return returnValue;
+	// Set the maximum number of bytes the shared request cache can use, existing entries are dropped.
+	void Request::SetCacheSize(size_t maxBytes)
+	{
+		GetSharedCache().responses.SetMaxBytes(maxBytes);
 	}
-	
-	void Listener::HelperWorkThread(std::unique_ptr<ConnectionBase> connection)
+
+	void Request::SetResolveTtl(float ttlSeconds)
 	{
-		try
+#if defined(__GNUC__)
+		AddressCache::Get().SetTtl(ttlSeconds);
+#endif
+	}
+
+	// Set the circuit breaker policy for blocking Send, SendStream and SendForFile calls of all requests.
+	//    Changing it closes every circuit.
+	void Request::SetCircuitBreaker(CircuitBreakerPolicy const &policy)
+	{
+		CircuitBreakers &circuitBreakers = GetCircuitBreakers();
+		std::lock_guard<std::mutex> guard(circuitBreakers.lock);
+		circuitBreakers.policy = policy;
+		for(auto &entry : circuitBreakers.breakers)
 		{
-			HelperWork(connection);
-			connection->Stop();
+			entry.second.stats.state = CircuitState::Closed;
+			entry.second.stats.consecutiveFailures = 0;
 		}
-		catch(...){}
-		--activeThreadCount;
 	}
-}
 
+	std::vector<EndpointStats> Request::GetEndpointStats(void)
+	{
+		CircuitBreakers &circuitBreakers = GetCircuitBreakers();
+		std::lock_guard<std::mutex> guard(circuitBreakers.lock);
+		auto now = std::chrono::steady_clock::now();
+		std::vector<EndpointStats> stats;
+		stats.reserve(circuitBreakers.breakers.size());
+		for(auto const &entry : circuitBreakers.breakers)
+		{
+			stats.push_back(entry.second.stats);
+			// an open circuit whose time is up lets the next call through
+			if(stats.back().state == CircuitState::Open && entry.second.openUntil <= now)
+				stats.back().state = CircuitState::HalfOpen;
+		}
+		return stats;
+	}
+}
 
 
-// helper functions for Request
-namespace
+// netfunc Client definitions
+namespace netfunc
 {
-	netfunc::ErrorResult HelperRequest(std::string const &address, uint16_t port, std::string const &name, 
-		nlohmann::json const &args, nlohmann::json &result, float timeoutSeconds,
-		std::unique_ptr<netfunc::ConnectionBase> &connection, 
-		netfunc::StringSerializationType serializeFunction, netfunc::StringDeserializationType deserializeFunction)
+	namespace
 	{
-		nlohmann::json fullRequest;
-		fullRequest.emplace("name", name);
-		fullRequest.emplace("args", args);
+		// weight of the newest call in the latency average
+		const double latencyAlpha = 0.2;
 
-		// create the json as a string
-		std::string requestString;
-		try
+		// most hedges that can be saved up for a burst of slow calls
+		const double maxHedgeTokens = 10.0;
+	}
+
+	const size_t Client::maxLatencySamples;
+	const size_t Client::minLatencySamples;
+
+	Client::Client()
+	{
+		std::random_device random;
+		randomState = ((uint64_t(random()) << 32) | random()) | 1;
+	}
+
+	void Client::AddEndpoint(std::string const &address, uint16_t port)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		Endpoint endpoint = { address, port, 0, 0.0, 0, false, std::chrono::steady_clock::time_point() };
+		endpoints.push_back(endpoint);
+	}
+
+	void Client::SetBalance(Balance policy)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		balance = policy;
+	}
+
+	void Client::SetEjection(uint32_t failures, float seconds, float maxFraction)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		failuresToEject = failures;
+		ejectSeconds = seconds;
+		maxEjectedFraction = maxFraction;
+	}
+
+	void Client::SetHedging(float percentile, float maxExtraFraction)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		hedgePercentile = percentile;
+		hedgeBudget = maxExtraFraction;
+		samplesSinceEstimate = minLatencySamples;
+	}
+
+	// Picks the endpoint for a call and counts the call as outstanding there. Call with lock held.
+	// exclude : an endpoint that can't be picked, or endpoints.size() for none
+	// return : the endpoint, or endpoints.size() if there was none to pick
+	size_t Client::HelperPick(size_t exclude)
+	{
+		auto now = std::chrono::steady_clock::now();
+		std::vector<size_t> candidates;
+		candidates.reserve(endpoints.size());
+		for(size_t i = 0; i < endpoints.size(); ++i)
 		{
-			requestString = fullRequest.dump();
+			Endpoint &endpoint = endpoints[i];
+			if(endpoint.ejected && endpoint.ejectedUntil <= now)
+			{
+				endpoint.ejected = false;
+				endpoint.failures = 0;
+			}
+			if(!endpoint.ejected && i != exclude)
+				candidates.push_back(i);
 		}
-		catch(...)
+
+		// with everything left out, calls still have to go somewhere
+		if(candidates.empty())
+			for(size_t i = 0; i < endpoints.size(); ++i)
+				if(i != exclude)
+					candidates.push_back(i);
+		if(candidates.empty())
+			return endpoints.size();
+
+		auto nextRandom = [this]()
 		{
-			return netfunc::ErrorResult::Bad_Json;
+			randomState ^= randomState >> 12;
+			randomState ^= randomState << 25;
+			randomState ^= randomState >> 27;
+			return randomState * 2685821657736338717ull;
+		};
+		size_t first = candidates[nextRandom() % candidates.size()];
+		size_t picked = first;
+		if(candidates.size() > 1)
+		{
+			size_t second = candidates[nextRandom() % (candidates.size() - 1)];
+			if(second == first)
+				second = candidates.back();
+
+			Endpoint const &a = endpoints[first];
+			Endpoint const &b = endpoints[second];
+			bool takeSecond;
+			if(balance == Balance::Outstanding)
+				takeSecond = b.outstanding < a.outstanding ||
+					(b.outstanding == a.outstanding && b.latencySeconds < a.latencySeconds);
+			else
+				takeSecond = b.latencySeconds * (b.outstanding + 1) < a.latencySeconds * (a.outstanding + 1);
+			picked = takeSecond ? second : first;
 		}
+		++endpoints[picked].outstanding;
+		return picked;
+	}
 
-		// pass the string through the serializer
-		std::unique_ptr<char[]> buffer;
-		uint16_t sizeBytes = 0;
-		if(!serializeFunction(requestString, buffer, sizeBytes))
-			return netfunc::ErrorResult::Bad_String;
+	// Records how a call went on its endpoint. Call with lock held.
+	// cancelled : the call lost to a hedge, it says nothing about the endpoint
+	void Client::HelperFinish(size_t index, ErrorResult result, double seconds, bool cancelled)
+	{
+		Endpoint &endpoint = endpoints[index];
+		--endpoint.outstanding;
+		if(cancelled)
+			return;
+		// an open circuit is the breaker having seen the endpoint fail
+		if(!IsEndpointFailure(result) && result != ErrorResult::Circuit_Open)
+		{
+			endpoint.failures = 0;
+			if(result != ErrorResult::Call_Ok)
+				return;
+			endpoint.latencySeconds = (endpoint.latencySeconds == 0.0) ? seconds :
+				endpoint.latencySeconds + latencyAlpha * (seconds - endpoint.latencySeconds);
 
-		// start the connection
-		if(!connection->Setup(0))
-			return netfunc::ErrorResult::Net_Error;
-		if(!connection->Connect(address, port))
+			if(latencySamples.size() < maxLatencySamples)
+				latencySamples.push_back(seconds);
+			else
+				latencySamples[nextSample] = seconds;
+			nextSample = (nextSample + 1) % maxLatencySamples;
+
+			// the percentile only has to follow slow changes, so it isn't worked out on every call
+			if(latencySamples.size() >= minLatencySamples && ++samplesSinceEstimate >= minLatencySamples)
+			{
+				samplesSinceEstimate = 0;
+				std::vector<double> sorted(latencySamples);
+				size_t rank = std::min(sorted.size() - 1, size_t(hedgePercentile * sorted.size()));
+				std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+				hedgeDelaySeconds = sorted[rank];
+			}
+			return;
+		}
+
+		if(endpoint.ejected || ++endpoint.failures < failuresToEject)
+			return;
+		size_t ejectedCount = 0;
+		for(auto const &other : endpoints)
+			if(other.ejected)
+				++ejectedCount;
+		if(ejectedCount + 1 > size_t(maxEjectedFraction * endpoints.size()))
+			return;
+
+		endpoint.ejected = true;
+		endpoint.ejectedUntil = std::chrono::steady_clock::now() + 
+			std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(ejectSeconds));
+	}
+
+	// Get the endpoints ready before calls go out, each one is connected to a few times.
+	// return : how many endpoints could be reached
+	size_t Client::Warm(Request &request, uint32_t connectionsPerEndpoint, float timeoutSeconds)
+	{
+		std::vector<std::pair<std::string, uint16_t>> targets;
 		{
-			connection->Stop();
-			return netfunc::ErrorResult::Net_Error;
+			std::lock_guard<std::mutex> guard(lock);
+			for(auto const &endpoint : endpoints)
+				targets.emplace_back(endpoint.address, endpoint.port);
 		}
 
-		// send the string
-		if(!connection->Send(buffer, sizeBytes))
+		// the first call on this thread finds its buffers ready
 		{
-			connection->Stop();
-			return netfunc::ErrorResult::Net_Error;
+			PooledBuffer warmBuffer(maxMessageBytes);
+			std::memset(warmBuffer.buffer.get(), 0, maxMessageBytes);
 		}
-		buffer.reset();
-		sizeBytes = 0;
 
-		// wait for response
-		std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
-		for(;;)
+		size_t reached = 0;
+		for(size_t i = 0; i < targets.size(); ++i)
 		{
-			// check for timeout
-			std::chrono::steady_clock::time_point nowTime = std::chrono::steady_clock::now();
-			if(std::chrono::duration_cast<std::chrono::duration<double>>(nowTime-startTime).count() > timeoutSeconds)
+			ErrorResult error = ErrorResult::Call_Ok;
+			for(uint32_t j = 0; j < connectionsPerEndpoint && error == ErrorResult::Call_Ok; ++j)
+				error = request.HelperProbe(targets[i].first, targets[i].second, timeoutSeconds);
+
+			std::lock_guard<std::mutex> guard(lock);
+			if(i >= endpoints.size())
+				break;
+			if(error == ErrorResult::Call_Ok)
 			{
-				connection->Stop();
-				return netfunc::ErrorResult::Request_Timeout;
+				endpoints[i].failures = 0;
+				++reached;
 			}
-			
-			// get data
-			if(!connection->Recv(buffer, sizeBytes))
+			else
 			{
-				connection->Stop();
-				return netfunc::ErrorResult::Net_Error;
+				++endpoints[i].outstanding;
+				HelperFinish(i, error, 0.0, false);
 			}
-			if(buffer)
-				break;
-			
-			std::this_thread::sleep_for(std::chrono::milliseconds(1));
 		}
+		return reached;
+	}
 
-		// close connection
-		connection->Stop();
-
-		// pass buffer to deserializer
-		std::string returnString;
-		if(!deserializeFunction(buffer, sizeBytes, returnString))
-			return netfunc::ErrorResult::Return_Error;
+	ErrorResult Client::Route(std::function<ErrorResult(std::string const &address, uint16_t port)> const &call)
+	{
+		size_t index;
+		std::string address;
+		uint16_t port;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			if(endpoints.empty())
+				return ErrorResult::Invalid_Address;
+			index = HelperPick(endpoints.size());
+			address = endpoints[index].address;
+			port = endpoints[index].port;
+			hedgeTokens = std::min(maxHedgeTokens, hedgeTokens + hedgeBudget);
+		}
 
-		// get string as json
+		auto start = std::chrono::steady_clock::now();
+		ErrorResult result = ErrorResult::Net_Error;
 		try
 		{
-			result = nlohmann::json::parse(returnString.c_str());
+			result = call(address, port);
 		}
 		catch(...)
 		{
-			return netfunc::ErrorResult::Return_Error;
+			std::lock_guard<std::mutex> guard(lock);
+			HelperFinish(index, ErrorResult::Return_Error, 0.0, false);
+			throw;
 		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-		return netfunc::ErrorResult::Call_Ok;
+		std::lock_guard<std::mutex> guard(lock);
+		HelperFinish(index, result, seconds, false);
+		return result;
 	}
 
-	void HelperRequestThread(std::string address, uint16_t port, std::string name, nlohmann::json args,
-		float timeoutSeconds, std::unique_ptr<netfunc::ConnectionBase> connection, 
-		netfunc::StringSerializationType serializeFunction, netfunc::StringDeserializationType deserializeFunction)
+	ErrorResult Client::Send(Request &request, std::string const &name, json const &args, float timeoutSeconds)
 	{
-		nlohmann::json result;
-		try
+		return Route([&](std::string const &address, uint16_t port)
 		{
-			HelperRequest(address, port, name, args, result, timeoutSeconds,
-				connection, serializeFunction, deserializeFunction);
-		}
-		catch(...){}
+			return request.Send(address, port, name, args, true, timeoutSeconds);
+		});
 	}
-}
 
-// definition for Request
-namespace netfunc
-{
-	// Send a request to execute a function on a listening connection.
-	// address, port : location to try to connect to
-	// name : the name bound to the function on the listening connection
-	// args : the arguments that are passed to the function
-	// waitForResult : should the function block until the remote function has finished
-	//    if true, function will block
-	//    if false, function will spawn a detached thread that handles the function call. there will not be a result.
-	// timeoutSeconds : this is the maximum amount of time that the function can take to execute
-	ErrorResult Request::Send(std::string const &address, uint16_t port, std::string const &name, nlohmann::json const &args, 
-		bool waitForResult, float timeoutSeconds)
+	ErrorResult Client::SendHedged(Request &request, Request &hedge, std::string const &name, json const &args, float timeoutSeconds)
 	{
-		try
+		size_t indexes[2] = { 0, 0 };
+		double delaySeconds;
+		bool canHedge;
+		std::string address;
+		uint16_t port;
 		{
-			if(connection == nullptr)
-#if defined(__GNUC__)
-				connection.reset(new DefaultConnection());
-#else
-				return ErrorResult::No_Default;
-#endif
+			std::lock_guard<std::mutex> guard(lock);
+			if(endpoints.empty())
+				return ErrorResult::Invalid_Address;
+			indexes[0] = HelperPick(endpoints.size());
+			hedgeTokens = std::min(maxHedgeTokens, hedgeTokens + hedgeBudget);
+			delaySeconds = hedgeDelaySeconds;
+			// no hedge until there are enough calls to know what slow is
+			canHedge = delaySeconds > 0.0 && hedgeTokens >= 1.0 && endpoints.size() > 1;
+			address = endpoints[indexes[0]].address;
+			port = endpoints[indexes[0]].port;
+		}
 
-			if(serializeFunction == nullptr || deserializeFunction == nullptr)
+		// each call reports back here, the first good answer wins
+		std::mutex doneLock;
+		std::condition_variable doneSignal;
+		Request *requests[2] = { &request, &hedge };
+		ErrorResult results[2] = { ErrorResult::Net_Error, ErrorResult::Net_Error };
+		double seconds[2] = { 0.0, 0.0 };
+		bool done[2] = { false, false };
+		int winner = -1;
+		auto runCall = [&](int which, std::string address, uint16_t port)
+		{
+			auto start = std::chrono::steady_clock::now();
+			ErrorResult result;
+			try
+			{
+				result = requests[which]->Send(address, port, name, args, true, timeoutSeconds);
+			}
+			catch(...)
 			{
-				serializeFunction = DefaultStringSerialization;
-				deserializeFunction = DefaultStringDeserialization;
+				result = ErrorResult::Net_Error;
 			}
+			std::lock_guard<std::mutex> guard(doneLock);
+			results[which] = result;
+			seconds[which] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			done[which] = true;
+			if(result == ErrorResult::Call_Ok && winner < 0)
+				winner = which;
+			doneSignal.notify_all();
+		};
 
-			if (waitForResult)
+		// the call only gets its own thread if a hedge may have to go out while it runs
+		std::thread calls[2];
+		if(canHedge)
+			calls[0] = std::thread(runCall, 0, address, port);
+		else
+			runCall(0, address, port);
+
+		bool hedged = false;
+		if(canHedge)
+		{
+			std::unique_lock<std::mutex> doneGuard(doneLock);
+			bool answered = doneSignal.wait_for(doneGuard, std::chrono::duration<double>(delaySeconds), [&]{ return done[0]; });
+			doneGuard.unlock();
+			if(!answered)
 			{
-				// do things in this thread
-				return HelperRequest(address, port, name, args, result, timeoutSeconds, 
-					connection, serializeFunction, deserializeFunction);
+				std::lock_guard<std::mutex> guard(lock);
+				if(hedgeTokens >= 1.0)
+				{
+					indexes[1] = HelperPick(indexes[0]);
+					if(indexes[1] != endpoints.size())
+					{
+						hedgeTokens -= 1.0;
+						hedged = true;
+						calls[1] = std::thread(runCall, 1, endpoints[indexes[1]].address, endpoints[indexes[1]].port);
+					}
+				}
 			}
-			else
+		}
+
+		// wait for a good answer, or for every call to fail
+		int loser = -1;
+		{
+			std::unique_lock<std::mutex> doneGuard(doneLock);
+			doneSignal.wait(doneGuard, [&]{ return winner >= 0 || (done[0] && (!hedged || done[1])); });
+			if(hedged && winner >= 0 && !done[1 - winner])
 			{
-				// spawn helper thread
-				std::thread t(HelperRequestThread, address, port, name, args, timeoutSeconds, std::move(connection), 
-					serializeFunction, deserializeFunction);
-				t.detach();
-				return ErrorResult::Call_Ok;
+				loser = 1 - winner;
+				requests[loser]->Cancel();
 			}
 		}
-		catch(...)
+		if(canHedge)
+			calls[0].join();
+		if(hedged)
+			calls[1].join();
+		if(loser >= 0)
+			*requests[loser]->running = true;
+
 		{
-			return ErrorResult::Net_Error;
+			std::lock_guard<std::mutex> guard(lock);
+			HelperFinish(indexes[0], results[0], seconds[0], loser == 0);
+			if(hedged)
+				HelperFinish(indexes[1], results[1], seconds[1], loser == 1);
+		}
+
+		if(winner == 1)
+		{
+			request.result = std::move(hedge.result);
+			request.resultAttachments = std::move(hedge.resultAttachments);
 		}
+		return winner >= 0 ? ErrorResult::Call_Ok : results[0];
 	}
 }
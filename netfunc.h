@@ -8,15 +8,118 @@
 #define NETWORKTRANSPARENTFUNCTIONCALL_H_
 #include "json/json.hpp"
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <cstdint>
+#include <functional>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 namespace netfunc
 {
-	typedef void (*NetFuncType)(nlohmann::json const &args, nlohmann::json &result);
+	// Hands out the memory for the json documents of a request being handled by a listener. Memory comes from
+	//    large blocks that are kept between requests and reset all at once, so steady state handling doesn't
+	//    go to the heap. Every thread has its own arena, it is only used while a RequestArenaScope is alive.
+	class RequestArena
+	{
+		static const size_t blockBytes = 64 * 1024;
+		static const size_t maxKeptBytes = 1024 * 1024;
+		struct Block
+		{
+			std::unique_ptr<char[]> memory;
+			size_t sizeBytes;
+		};
+		std::vector<Block> blocks;
+		size_t currentBlock = 0;
+		size_t currentOffset = 0;
+		uint32_t activeScopes = 0;
+		uint32_t pausedScopes = 0;
+		friend class RequestArenaScope;
+		friend class RequestArenaPause;
+
+	public:
+		// The arena for the calling thread.
+		static RequestArena &ThreadArena(void);
+
+		// Returns memory for sizeBytes, the memory is tagged so Deallocate knows where it came from.
+		static void *Allocate(size_t sizeBytes);
+
+		// Gives heap memory back, arena memory is only reclaimed when the arena resets.
+		static void Deallocate(void *memory);
+	};
+
+	// While alive, json allocations on this thread come from its arena. The arena is reset when the outermost
+	//    scope is destroyed, so no json allocated inside may outlive it.
+	class RequestArenaScope
+	{
+	public:
+		RequestArenaScope();
+		~RequestArenaScope();
+		RequestArenaScope(RequestArenaScope&) = delete;
+		void operator=(RequestArenaScope&) = delete;
+	};
+
+	// While alive, json allocations on this thread go to the heap even inside a RequestArenaScope. Used for
+	//    documents that only live for part of a request, like the chunks of a stream, so they don't pile up
+	//    in the arena until the request is done.
+	class RequestArenaPause
+	{
+	public:
+		RequestArenaPause();
+		~RequestArenaPause();
+		RequestArenaPause(RequestArenaPause&) = delete;
+		void operator=(RequestArenaPause&) = delete;
+	};
+
+	// Stateless allocator for nlohmann::basic_json that uses the thread's arena when a scope is active.
+	template <typename T>
+	class ArenaAllocator
+	{
+	public:
+		typedef T value_type;
+
+		ArenaAllocator() = default;
+		template <typename U>
+		ArenaAllocator(ArenaAllocator<U> const &) {}
+
+		T *allocate(size_t count) { return static_cast<T*>(RequestArena::Allocate(count * sizeof(T))); }
+		void deallocate(T *memory, size_t) { RequestArena::Deallocate(memory); }
+
+		template <typename U, typename... Args>
+		void construct(U *object, Args&&... args) { ::new(static_cast<void*>(object)) U(std::forward<Args>(args)...); }
+		template <typename U>
+		void destroy(U *object) { object->~U(); }
+
+		template <typename U>
+		bool operator==(ArenaAllocator<U> const &) const { return true; }
+		template <typename U>
+		bool operator!=(ArenaAllocator<U> const &) const { return false; }
+	};
+
+	// The json type used for args and results. Define NETFUNC_ARENA_JSON to back the documents a listener
+	//    handles with the request arena, functions must then not keep any part of args or result after they return.
+#if defined(NETFUNC_ARENA_JSON)
+	typedef nlohmann::basic_json<std::map, std::vector, std::string, bool, std::int64_t, std::uint64_t, double, ArenaAllocator> json;
+#else
+	typedef nlohmann::json json;
+#endif
+
+	class StreamWriter;
+	class StreamReader;
+	class Attachments;
+	struct FileRange;
+	typedef void (*NetFuncType)(json const &args, json &result);
+	typedef void (*NetStreamFuncType)(json const &args, StreamWriter &writer, json &result);
+	typedef void (*NetUploadFuncType)(json const &args, StreamReader &reader, json &result);
+	typedef void (*NetAttachmentFuncType)(json const &args, Attachments const &argAttachments, json &result, Attachments &resultAttachments);
+	typedef void (*NetFileFuncType)(json const &args, json &result, FileRange &file);
 	typedef bool (*StringSerializationType)(std::string const &input, std::unique_ptr<char[]> &outBuffer, uint16_t &outSizeBytes);
 	typedef bool (*StringDeserializationType)(std::unique_ptr<char[]> const &inBuffer, uint16_t inSizeBytes, std::string &output);
 
@@ -32,6 +135,97 @@ namespace netfunc
 		Bad_Json,         // There was an exception when parsing the json
 		Return_Error,     // Remote function executed but parsing the return failed
 		No_Default,       // The default connection is not supported with the current configuration
+		Connect_Timeout,  // The listener could not be reached before the timeout
+		Circuit_Open,     // Calls to that listener have been failing, the call was not made
+	};
+
+	// Largest message a connection has to carry.
+	const uint32_t maxMessageBytes = 65535;
+
+	// A piece of memory to send, owned by the caller.
+	struct SendSpan
+	{
+		char const *data;
+		size_t sizeBytes;
+	};
+
+	// Socket level tuning used by the default connection, other connections can ignore it. Zero or false leaves
+	//    a setting at the system default.
+	struct SocketOptions
+	{
+		// TCP_NODELAY, send small messages right away instead of waiting to fill a packet
+		bool noDelay = false;
+		// TCP_QUICKACK, acknowledge received data right away instead of waiting to send it with a reply
+		bool quickAck = false;
+		// SO_BUSY_POLL, microseconds to spin on the device queue in a blocking read, may need CAP_NET_ADMIN
+		int busyPollMicroseconds = 0;
+		// TCP_DEFER_ACCEPT, listeners only, seconds to hold a connection back from accept until data arrives
+		int deferAcceptSeconds = 0;
+		// SO_SNDBUF and SO_RCVBUF
+		int sendBufferBytes = 0;
+		int recvBufferBytes = 0;
+		// SO_KEEPALIVE, seconds a connection is idle before it is probed, 0 leaves keepalive off. Then
+		//    TCP_KEEPINTVL seconds between probes and TCP_KEEPCNT unanswered probes before it is dropped
+		int keepAliveIdleSeconds = 0;
+		int keepAliveIntervalSeconds = 0;
+		int keepAliveCount = 0;
+		// TCP_USER_TIMEOUT, milliseconds sent data can go unacknowledged before the connection is dropped
+		int userTimeoutMs = 0;
+
+		// For small calls that should be answered as soon as possible.
+		static SocketOptions Latency(void)
+		{
+			SocketOptions options;
+			options.noDelay = true;
+			options.quickAck = true;
+			options.busyPollMicroseconds = 50;
+			options.deferAcceptSeconds = 1;
+			return options;
+		}
+
+		// For large results, files and streams, fewer wakeups and bigger windows.
+		static SocketOptions Throughput(void)
+		{
+			SocketOptions options;
+			options.deferAcceptSeconds = 1;
+			options.sendBufferBytes = 4 * 1024 * 1024;
+			options.recvBufferBytes = 4 * 1024 * 1024;
+			return options;
+		}
+	};
+
+	// A range of an open file, sent after a result without going through a buffer.
+	struct FileRange
+	{
+		int fd = -1;
+		uint64_t offset = 0;
+		uint64_t sizeBytes = 0;
+		// close fd once the range has been sent or the call failed
+		bool closeWhenSent = false;
+	};
+
+	// Limits on the connections a listener without helper threads waits on, so many slow or idle requesters
+	//    can't make it hold more and more memory. With helper threads the connections are limited by helperNum.
+	struct ConnectionLimits
+	{
+		// a connection that sent nothing for this long is dropped, 0 only drops it at the listener's timeout.
+		//    Connections without a PollHandle can't be told apart from idle ones and are left to the timeout
+		float idleSeconds = 0.0f;
+		// most connections waited on at once, answered ones that are still lingering are closed first and then
+		//    the one that has been quiet longest is dropped to make room for a new one, 0 is no limit
+		uint32_t maxConnections = 0;
+		// most bytes the connections can hold together, the ones that have been quiet longest are dropped
+		//    until they fit, 0 is no limit
+		size_t maxHeldBytes = 0;
+	};
+
+	// What the connections a listener without helper threads waits on hold, and how many were dropped.
+	struct ConnectionStats
+	{
+		size_t connections;
+		size_t heldBytes;
+		uint64_t idleDropped;
+		uint64_t evicted;
 	};
 
 	class ConnectionBase
@@ -47,11 +241,24 @@ namespace netfunc
 		// Destroys the open connection.
 		virtual void Stop(void) = 0;
 
+		// Sets the socket options used from the next Setup on, connections accepted from a listening connection
+		//    get them too. By default they are ignored.
+		virtual void SetOptions(SocketOptions const &) {}
+
 		// Try to open connection to remote listener. This should block until the connection returns good or not.
-		// address, port : location to try to connect to
+		// address, port : location to try to connect to, the default connection takes host names as well as
+		//    IPv4 and IPv6 addresses
 		// return : true if successfully connected, false if not
 		virtual bool Connect(std::string const &address, uint16_t port) = 0;
 
+		// Try to open connection to remote listener, giving up once timeoutSeconds have passed. This is what
+		//    netfunc uses to connect, by default it calls Connect and can't tell why it failed.
+		// address, port : location to try to connect to
+		// timeoutSeconds : the maximum amount of time to wait, negative to wait as long as Connect would
+		// return : Call_Ok if connected, Invalid_Address if nothing is listening there, Connect_Timeout if the
+		//    time ran out, Net_Error for anything else
+		virtual ErrorResult ConnectWithin(std::string const &address, uint16_t port, float timeoutSeconds);
+
 		// Set the connection to start listening.
 		// acceptQueueSize : requested size of the accept queue
 		// return : true if successfully listening, false if not
@@ -75,6 +282,306 @@ namespace netfunc
 		// outBuffer : the buffer with the read data in it, or nullptr if there was no data ready to read
 		// outSizeBytes : size of the buffer returned
 		virtual bool Recv(std::unique_ptr<char[]> &outBuffer, uint16_t &outSizeBytes) = 0;
+
+		// Gives back a buffer returned by Recv once it is no longer needed, so it can be reused.
+		// buffer : the buffer from Recv, it is empty after this call
+		// sizeBytes : the size Recv returned with the buffer
+		virtual void ReleaseBuffer(std::unique_ptr<char[]> &buffer, uint16_t) { buffer.reset(); }
+
+		// Sends the parts as one message, the same way Send does. This is what netfunc uses to send, by default
+		//    the parts are gathered into one buffer and passed to Send.
+		// parts : the memory to send, in order
+		// partCount : number of parts
+		// return : true if successfully sent, false if not
+		virtual bool SendParts(SendSpan const *parts, uint32_t partCount);
+
+		// Try to receive a message into a buffer owned by the caller, the same way Recv does. This is what
+		//    netfunc uses to receive, by default the buffer from Recv is copied into the caller's buffer.
+		// buffer, capacityBytes : where to put the message, a message that doesn't fit is an error
+		// return : true if the connection is still in a good state, false if not
+		// outSizeBytes : size of the message received
+		// outReceived : false if there was no data ready to read
+		virtual bool RecvInto(char *buffer, uint32_t capacityBytes, uint16_t &outSizeBytes, bool &outReceived);
+
+		// Sends a range of a file as messages of at most maxMessageBytes, each received the same way as one sent
+		//    with Send. By default each piece is read into a buffer and passed to SendParts.
+		// fd, offset, sizeBytes : the range to send, the file position of fd is not used
+		// return : true if the whole range was sent, false if not
+		virtual bool SendFile(int fd, uint64_t offset, uint64_t sizeBytes);
+
+		// Try to receive a message without blocking at all, a message that has only partly arrived is kept by
+		//    the connection until the rest comes in. This is what the cooperative Update uses, by default it
+		//    calls RecvInto.
+		// buffer, capacityBytes : where to put the message, a message that doesn't fit is an error
+		// return : true if the connection is still in a good state, false if not
+		// outSizeBytes : size of the message received
+		// outReceived : false if there was no whole message ready to read
+		virtual bool RecvAvailable(char *buffer, uint32_t capacityBytes, uint16_t &outSizeBytes, bool &outReceived);
+
+		// Gets how many bytes of memory the connection holds, for its state and messages that have partly arrived,
+		//    so a listener can account for the connections it waits on. By default it only counts itself.
+		virtual size_t HeldBytes(void) const { return sizeof(*this); }
+
+		// Gets a descriptor that polls readable when there is data to receive or a connection to accept, so many
+		//    connections can be waited on at once. By default there is none.
+		// return : the descriptor, or -1
+		virtual int PollHandle(void) const { return -1; }
+
+		// Takes over a socket that is already bound and listening, handed over by another process, in place of
+		//    Setup and Listen. By default it can't.
+		// fd : the listening socket, the connection owns it if it takes it
+		// return : true if the connection took it
+		virtual bool AdoptListening(int) { return false; }
+	};
+
+	// Base for connections that send from spans and receive into the caller's memory, without allocating or
+	//    handing over a buffer per message. Send and Recv are implemented on top of SendParts and RecvInto.
+	class SpanConnectionBase : public ConnectionBase
+	{
+	public:
+		virtual bool Send(std::unique_ptr<char[]> const &inBuffer, uint16_t sizeBytes) override;
+		virtual bool Recv(std::unique_ptr<char[]> &outBuffer, uint16_t &outSizeBytes) override;
+		virtual void ReleaseBuffer(std::unique_ptr<char[]> &buffer, uint16_t sizeBytes) override;
+
+		virtual bool SendParts(SendSpan const *parts, uint32_t partCount) override = 0;
+		virtual bool RecvInto(char *buffer, uint32_t capacityBytes, uint16_t &outSizeBytes, bool &outReceived) override = 0;
+	};
+
+	// Recycles the buffers frames are serialized and received into. Buffers are grouped into power of two size
+	//    classes, each thread keeps a few of each class and the rest go to a shared list.
+	//    Buffers are allocated with new[], so one that is never given back is still freed correctly.
+	class BufferPool
+	{
+	public:
+		// Gets a buffer that can hold at least sizeBytes.
+		static std::unique_ptr<char[]> Acquire(uint32_t sizeBytes);
+
+		// Gives back a buffer from Acquire, sizeBytes must be the size it was acquired with.
+		// The buffer is empty after this call.
+		static void Release(std::unique_ptr<char[]> &buffer, uint32_t sizeBytes);
+	};
+
+	// Named blocks of raw bytes sent next to the json args or result, so binary data doesn't have to be encoded
+	//    into json strings. All the attachments of a call are sent as one message, so together they have the
+	//    same size limit. Received attachments are views into the buffer they were received into.
+	class Attachments
+	{
+		struct Part
+		{
+			std::string name;
+			char const *data;
+			size_t sizeBytes;
+			std::unique_ptr<char[]> copy;
+		};
+		std::vector<Part> parts;
+		std::unique_ptr<char[]> received;
+		size_t totalBytes = 0;
+
+		bool HelperAdd(std::string const &name, char const *data, size_t sizeBytes, std::unique_ptr<char[]> copy);
+	public:
+		Attachments() = default;
+		Attachments(Attachments &&other) { *this = std::move(other); }
+		Attachments &operator=(Attachments &&other);
+		~Attachments() { Clear(); }
+
+		// Adds a copy of the bytes.
+		// return : false if the attachments would no longer fit in one message
+		bool Add(std::string const &name, void const *data, size_t sizeBytes);
+
+		// Adds the bytes without copying them, they have to stay valid until the attachments are sent.
+		// return : false if the attachments would no longer fit in one message
+		bool AddView(std::string const &name, void const *data, size_t sizeBytes);
+
+		// Looks up an attachment by name.
+		// return : true if found, the data and size are set to the attachment
+		bool Find(std::string const &name, char const *&outData, size_t &outSizeBytes) const;
+
+		size_t Count(void) const { return parts.size(); }
+		std::string const &Name(size_t index) const { return parts[index].name; }
+		char const *Data(size_t index) const { return parts[index].data; }
+		size_t SizeBytes(size_t index) const { return parts[index].sizeBytes; }
+		size_t TotalBytes(void) const { return totalBytes; }
+
+		// Removes all attachments.
+		void Clear(void);
+
+		// The names and sizes of the attachments, sent in the json so the other side can split the message.
+		json Describe(void) const;
+
+		// The memory to send, one span per attachment.
+		void Spans(std::vector<SendSpan> &outSpans) const;
+
+		// Takes over a received message and makes views into it, using the description from the other side.
+		// buffer : the message, acquired from BufferPool for maxMessageBytes, this object keeps it until cleared
+		// return : false if the description doesn't match the message
+		bool Receive(std::unique_ptr<char[]> &buffer, uint16_t sizeBytes, json const &description);
+	};
+
+	// Size bounded LRU of already serialized responses or results, split into shards so worker threads rarely share a lock.
+	// Entries are keyed by the function name plus the canonical dump of the args.
+	class ResponseCache
+	{
+	public:
+		struct Entry
+		{
+			std::unique_ptr<char[]> buffer;
+			uint16_t sizeBytes = 0;
+			// the message with the attachments of the response, sent right after it, if there are any
+			std::unique_ptr<char[]> attachments;
+			uint16_t attachmentBytes = 0;
+			bool expires = false;
+			std::chrono::steady_clock::time_point expireTime;
+			// whoever fills the cache can tag entries with the version of what made them
+			uint64_t generation = 0;
+		};
+
+	private:
+		static const uint32_t shardCount = 16;
+		typedef std::list<std::pair<std::string, std::shared_ptr<Entry const>>> OrderList;
+		struct Shard
+		{
+			std::mutex lock;
+			OrderList order;
+			std::unordered_map<std::string, OrderList::iterator> lookup;
+			size_t usedBytes = 0;
+		};
+		Shard shards[shardCount];
+		size_t maxBytesPerShard = (4 * 1024 * 1024) / shardCount;
+
+		Shard &HelperShard(std::string const &key);
+		void HelperErase(Shard &shard, OrderList::iterator it);
+
+	public:
+		// Sets the total number of bytes the cache can hold, existing entries are dropped.
+		void SetMaxBytes(size_t maxBytes);
+
+		// Looks up a response, returns nullptr if it is not cached or has expired.
+		std::shared_ptr<Entry const> Find(std::string const &key);
+
+		// Adds a response, evicting the least recently used entries if the shard is full.
+		void Insert(std::string const &key, std::shared_ptr<Entry const> entry);
+
+		// Drops all entries whose key starts with prefix.
+		void ErasePrefix(std::string const &prefix);
+
+		// Drops all entries.
+		void Clear(void);
+	};
+
+	// Given to streaming functions to send chunks of the result to the requester as they are produced.
+	//    The requester grants a window of chunks it is willing to have in flight, Write blocks while the window
+	//    is used up, so a slow requester slows the function down instead of piling up data.
+	class StreamWriter
+	{
+		ConnectionBase &connection;
+		StringSerializationType serializeFunction;
+		StringDeserializationType deserializeFunction;
+		std::atomic_bool const &running;
+		float timeoutSeconds;
+		uint32_t credits;
+		bool streaming;
+		bool good = true;
+		friend class Listener;
+
+		StreamWriter(ConnectionBase &conn, StringSerializationType serializeFunc, StringDeserializationType deserializeFunc,
+			std::atomic_bool const &isRunning, float timeout, uint32_t window, bool isStreaming)
+			: connection(conn), serializeFunction(serializeFunc), deserializeFunction(deserializeFunc), 
+			running(isRunning), timeoutSeconds(timeout), credits(window), streaming(isStreaming) {}
+	public:
+		StreamWriter(StreamWriter&) = delete;
+		void operator=(StreamWriter&) = delete;
+
+		// Sends a chunk to the requester. Each chunk is sent as its own message, so it has the same size limit.
+		// return : true if the chunk was sent, false if the chunk was too big or the stream is broken
+		//    a requester that used Send instead of SendStream has no stream, every chunk will fail
+		bool Write(json const &chunk);
+
+		// return : false once the requester has gone away or stopped reading, the function should stop
+		bool Good(void) const { return good && streaming; }
+	};
+
+	// Given to upload functions to read the chunks of args the requester sends after the call has started.
+	//    Chunks are read as they arrive, so the function can work on the first before the last is sent.
+	class StreamReader
+	{
+		ConnectionBase &connection;
+		StringDeserializationType deserializeFunction;
+		std::atomic_bool const &running;
+		float timeoutSeconds;
+		bool streaming;
+		bool finished = false;
+		bool good = true;
+		friend class Listener;
+
+		StreamReader(ConnectionBase &conn, StringDeserializationType deserializeFunc, std::atomic_bool const &isRunning,
+			float timeout, bool isStreaming)
+			: connection(conn), deserializeFunction(deserializeFunc), running(isRunning), timeoutSeconds(timeout),
+			streaming(isStreaming) {}
+	public:
+		StreamReader(StreamReader&) = delete;
+		void operator=(StreamReader&) = delete;
+
+		// Waits for the next chunk from the requester.
+		// chunk : filled with the next chunk
+		// return : true if there was a chunk, false once all of them have been read or the stream is broken
+		//    a requester that used Send instead of OpenUpload has no stream, there will be no chunks
+		bool Read(json &chunk);
+
+		// return : true if every chunk the requester sent has been read
+		bool Finished(void) const { return finished || !streaming; }
+
+		// return : false if the requester went away or stopped sending before finishing
+		bool Good(void) const { return good; }
+	};
+
+	// Timers on a hierarchical wheel of millisecond ticks, so scheduling, moving and cancelling a timer costs the
+	//    same however many there are. Timers further out sit on coarser wheels and move down to finer ones as
+	//    their time comes closer. Not thread safe, each event loop keeps its own.
+	class TimerWheel
+	{
+	public:
+		// Embedded in whatever it times, it is linked into the wheel while it is scheduled.
+		struct Timer
+		{
+			Timer *next = nullptr;
+			Timer *prev = nullptr;
+			uint64_t dueTick = 0;
+
+			Timer() = default;
+			Timer(Timer&) = delete;
+			void operator=(Timer&) = delete;
+			bool Scheduled(void) const { return next != nullptr; }
+		};
+
+		TimerWheel();
+		TimerWheel(TimerWheel&) = delete;
+		void operator=(TimerWheel&) = delete;
+
+		// Schedules a timer, or moves it if it is scheduled already.
+		void Schedule(Timer &timer, std::chrono::steady_clock::time_point due);
+
+		// Takes a timer off the wheel, it may or may not be scheduled.
+		void Cancel(Timer &timer);
+
+		// Turns the wheel up to now, every timer that came due is taken off it and passed to expired.
+		void Advance(std::chrono::steady_clock::time_point now, std::function<void(Timer&)> const &expired);
+
+		// Gets a time no later than when the next timer comes due.
+		// return : false if no timer is scheduled
+		bool NextDue(std::chrono::steady_clock::time_point &outDue) const;
+
+		size_t Count(void) const { return count; }
+	private:
+		static const uint32_t slotBits = 6;
+		static const uint32_t slotCount = 1 << slotBits;
+		static const uint32_t levelCount = 4;
+		// each slot is the head of a circular list of timers
+		Timer slots[levelCount][slotCount];
+		std::chrono::steady_clock::time_point start;
+		uint64_t currentTick = 0;
+		size_t count = 0;
+
+		void HelperInsert(Timer &timer);
 	};
 
 	class Listener
@@ -88,34 +595,237 @@ namespace netfunc
 		std::atomic_uint activeThreadCount = ATOMIC_VAR_INIT(0);
 		std::atomic<ErrorResult> threadedError = ATOMIC_VAR_INIT(ErrorResult::Net_Error);
 
-		std::map<std::string, NetFuncType> functions;
-		NetFuncType defaultFunction = nullptr;
+		// calls in flight keep going while this is set, Stop clears it when the drain deadline passes
+		std::atomic_bool handling = ATOMIC_VAR_INIT(false);
+		bool accepting = false;
+		std::mutex stopLock;
+		std::condition_variable stopSignal;
+
+		// connections the cooperative Update is waiting on when there are no helper threads, their descriptors
+		//    are gathered in one set that can be polled from outside
+		struct Waiting : TimerWheel::Timer
+		{
+			std::list<Waiting>::iterator self;
+			std::unique_ptr<ConnectionBase> connection;
+			std::chrono::steady_clock::time_point deadline;
+			std::chrono::steady_clock::time_point lastActive;
+			size_t heldBytes;
+			size_t queuedIndex;
+			bool polled;
+			bool ready;
+			bool answered;
+		};
+		std::list<Waiting> waiting;
+		int pollSet = -1;
+
+		// each waiting connection has a timer for its next deadline, an Update only looks at the connections
+		//    that can be read or came due, queued as they are found
+		TimerWheel timers;
+		std::vector<Waiting*> queued;
+		size_t unpolledCount = 0;
+
+		// the waiting list is kept with the connection that was active last at the back, so the ones dropped
+		//    to stay in the limits are taken from the front. The stats are read from other threads
+		ConnectionLimits connectionLimits;
+		std::atomic<size_t> waitingCount = ATOMIC_VAR_INIT(0);
+		std::atomic<size_t> waitingHeldBytes = ATOMIC_VAR_INIT(0);
+		std::atomic<uint64_t> idleDropped = ATOMIC_VAR_INIT(0);
+		std::atomic<uint64_t> evicted = ATOMIC_VAR_INIT(0);
+
+		// helper threads started with the listener that wait for connections, instead of a thread being started
+		//    for each call
+		uint32_t warmThreadCount = 0;
+		std::mutex parkLock;
+		std::condition_variable parkSignal;
+		std::vector<std::unique_ptr<ConnectionBase>> parkedWork;
+		size_t parkedThreads = 0;
+
+		// endpoints listened on next to the port passed to Start, they all feed the same functions and threads
+		struct Endpoint
+		{
+			std::unique_ptr<ConnectionBase> connection;
+			uint16_t port;
+		};
+		std::vector<Endpoint> endpoints;
+		size_t nextEndpoint = 0;
+		bool acceptPolled = false;
+
+		// calls whose requesters asked for heartbeats while the function runs, one thread sends them all. It is
+		//    started by the first of them
+		struct Heartbeat
+		{
+			ConnectionBase *connection;
+			std::chrono::steady_clock::time_point next;
+			std::chrono::steady_clock::duration interval;
+		};
+		std::list<Heartbeat> heartbeats;
+		std::mutex heartbeatLock;
+		std::condition_variable heartbeatSignal;
+		bool heartbeatStop = false;
+		std::thread heartbeatThread;
+
+		// a new listener process takes the listening sockets over through a unix socket at handOffPath
+		std::string handOffPath;
+		int handOffSocket = -1;
+		uint16_t listenPort = 0;
+		std::atomic_bool handedOff = ATOMIC_VAR_INIT(false);
+
+		struct FunctionEntry
+		{
+			NetFuncType func;
+			NetStreamFuncType streamFunc;
+			NetUploadFuncType uploadFunc;
+			NetAttachmentFuncType attachmentFunc;
+			NetFileFuncType fileFunc;
+			bool cacheable;
+			float cacheTtlSeconds;
+			// set when the entry is published, cached responses made by another generation are not used
+			uint64_t generation;
+		};
+
+		// the functions are copied on every change and the copy is published with one pointer swap, so dispatch
+		//    reads them without locking. Readers count themselves in one of two slots for the epoch they started
+		//    in, a replaced table is freed once its epoch has no readers left
+		struct FunctionTable
+		{
+			std::map<std::string, FunctionEntry> functions;
+			NetFuncType defaultFunction = nullptr;
+		};
+		std::atomic<FunctionTable const*> functionTable = ATOMIC_VAR_INIT(nullptr);
+		std::atomic_uint tableEpoch = ATOMIC_VAR_INIT(0);
+		std::atomic_uint tableReaders[2] = { {0}, {0} };
+		std::mutex tableLock;
+		uint64_t tableGeneration = 0;
+		ResponseCache responseCache;
+		SocketOptions socketOptions;
+
+		// invalidations are numbered so a requester can ask for the ones it has not seen yet
+		static const uint32_t maxInvalidationLog = 256;
+		uint64_t listenerId = 0;
+		std::mutex invalidationLock;
+		uint64_t invalidationSeq = 0;
+		std::list<std::pair<uint64_t, std::string>> invalidationLog;
+
+		// responses of calls that carried an idempotency key, so a retry gets the response instead of a second run
+		ResponseCache dedupeCache;
+		float dedupeWindowSeconds = 60.0f;
+		std::mutex dedupeLock;
+		std::condition_variable dedupeSignal;
+		std::unordered_set<std::string> dedupeRunning;
 		
 		ErrorResult HelperUpdate(float timeoutSeconds);
 		void HelperUpdateThread(void);
+		bool HelperFindFunction(std::string const &name, FunctionEntry &outEntry, NetFuncType &outDefault);
+		ErrorResult HelperChangeTable(std::function<ErrorResult(FunctionTable&)> const &change);
+		ErrorResult HelperAddEntry(std::string const &name, FunctionEntry const &entry, bool replace);
+		ErrorResult HelperCooperative(float timeoutSeconds);
+		bool HelperPoll(int waitMs);
+		ErrorResult HelperAdvance(void);
+		void HelperDropWaiting(void);
+		void HelperQueue(Waiting &entry);
+		void HelperSchedule(Waiting &entry);
+		void HelperDropEntry(Waiting &entry);
+		void HelperLimitWaiting(void);
+		void HelperCheckHandOff(void);
+		bool HelperAccept(std::unique_ptr<ConnectionBase> &newConnection);
+		ConnectionBase &HelperEndpoint(size_t index) { return index == 0 ? *listeningConnection : *endpoints[index - 1].connection; }
+		void HelperStopEndpoints(void);
 		ErrorResult HelperWork(std::unique_ptr<ConnectionBase> &connection);
+		ErrorResult HelperAnswer(std::unique_ptr<ConnectionBase> &connection, std::unique_ptr<char[]> const &received,
+			uint16_t receivedBytes, bool linger);
 		void HelperWorkThread(std::unique_ptr<ConnectionBase> connection);
+		void HelperParkedThread(void);
+		bool HelperHandToParked(std::unique_ptr<ConnectionBase> &connection);
+		void HelperLinger(void);
+		void HelperThreadExit(bool acceptThread);
+		void HelperHeartbeatThread(void);
 	public:
 		Listener() = default;
 		Listener(Listener&) = delete;
 		Listener(Listener&&) = delete;
 		void operator=(Listener&) = delete;
 		void operator=(Listener&&) = delete;
-		~Listener() { Stop(); }
+		~Listener() { Stop(); delete functionTable.load(); }
 
-		// Add a function to the listening system.
-		ErrorResult AddFunction(std::string const &name, NetFuncType func)
+		// Add a function to the listening system. Functions can be added, replaced and removed while the listener
+		//    is running.
+		// cacheable : the function always returns the same result for the same args, so the serialized response
+		//    is kept and sent again without calling the function
+		// cacheTtlSeconds : how long a cached response stays valid, 0 keeps it until it is evicted
+		ErrorResult AddFunction(std::string const &name, NetFuncType func, bool cacheable = false, float cacheTtlSeconds = 0.0f)
 		{
-			if(running) return ErrorResult::Listener_Started;
-			return (functions.emplace(name, func).second) ? ErrorResult::Call_Ok : ErrorResult::Func_Overwrite;
+			FunctionEntry entry = { func, nullptr, nullptr, nullptr, nullptr, cacheable, cacheTtlSeconds, 0 };
+			return HelperAddEntry(name, entry, false);
+		}
+
+		// Add a streaming function to the listening system. It sends chunks through the writer as they are
+		//    produced and fills result once done, requesters read them with SendStream.
+		ErrorResult AddStreamFunction(std::string const &name, NetStreamFuncType func)
+		{
+			FunctionEntry entry = { nullptr, func, nullptr, nullptr, nullptr, false, 0.0f, 0 };
+			return HelperAddEntry(name, entry, false);
+		}
+
+		// Add an upload function to the listening system. It is called as soon as the call is opened and reads
+		//    the chunks of args through the reader, requesters send them with OpenUpload and WriteChunk.
+		ErrorResult AddUploadFunction(std::string const &name, NetUploadFuncType func)
+		{
+			FunctionEntry entry = { nullptr, nullptr, func, nullptr, nullptr, false, 0.0f, 0 };
+			return HelperAddEntry(name, entry, false);
+		}
+
+		// Add a function that gets raw byte attachments next to its args and can return some with its result.
+		//    The arg attachments point into the receive buffer and are only valid until the function returns.
+		ErrorResult AddAttachmentFunction(std::string const &name, NetAttachmentFuncType func)
+		{
+			FunctionEntry entry = { nullptr, nullptr, nullptr, func, nullptr, false, 0.0f, 0 };
+			return HelperAddEntry(name, entry, false);
+		}
+
+		// Add a function that can name a range of a file to send after its result. The bytes go from the file
+		//    to the connection without being copied into the json, requesters read them with SendForFile.
+		ErrorResult AddFileFunction(std::string const &name, NetFileFuncType func)
+		{
+			FunctionEntry entry = { nullptr, nullptr, nullptr, nullptr, func, false, 0.0f, 0 };
+			return HelperAddEntry(name, entry, false);
+		}
+
+		// Swap a function for a new one of any kind, or add it if there was none by that name. Calls that were
+		//    already dispatched finish on the old function, cached responses of the old one are invalidated.
+		ErrorResult ReplaceFunction(std::string const &name, NetFuncType func, bool cacheable = false, float cacheTtlSeconds = 0.0f)
+		{
+			FunctionEntry entry = { func, nullptr, nullptr, nullptr, nullptr, cacheable, cacheTtlSeconds, 0 };
+			return HelperAddEntry(name, entry, true);
+		}
+		ErrorResult ReplaceFunction(std::string const &name, NetStreamFuncType func)
+		{
+			FunctionEntry entry = { nullptr, func, nullptr, nullptr, nullptr, false, 0.0f, 0 };
+			return HelperAddEntry(name, entry, true);
+		}
+		ErrorResult ReplaceFunction(std::string const &name, NetUploadFuncType func)
+		{
+			FunctionEntry entry = { nullptr, nullptr, func, nullptr, nullptr, false, 0.0f, 0 };
+			return HelperAddEntry(name, entry, true);
+		}
+		ErrorResult ReplaceFunction(std::string const &name, NetAttachmentFuncType func)
+		{
+			FunctionEntry entry = { nullptr, nullptr, nullptr, func, nullptr, false, 0.0f, 0 };
+			return HelperAddEntry(name, entry, true);
+		}
+		ErrorResult ReplaceFunction(std::string const &name, NetFileFuncType func)
+		{
+			FunctionEntry entry = { nullptr, nullptr, nullptr, nullptr, func, false, 0.0f, 0 };
+			return HelperAddEntry(name, entry, true);
 		}
 
+		// Take a function out of the listening system, its name goes to the default function from then on.
+		// name : the name bound to the function
+		void RemoveFunction(std::string const &name);
+
 		// Set the default function to call with the request when it doesn't match any of the other function names.
 		ErrorResult SetDefaultFunc(NetFuncType func)
 		{
-			if(running) return ErrorResult::Listener_Started;
-			defaultFunction = func;
-			return ErrorResult::Call_Ok;
+			return HelperChangeTable([func](FunctionTable &table) { table.defaultFunction = func; return ErrorResult::Call_Ok; });
 		}
 
 		// Set the string serialization functions for this object, make sure they match the ones that the other side uses.
@@ -126,6 +836,92 @@ namespace netfunc
 			return ErrorResult::Call_Ok;
 		}
 
+		// Set the maximum number of bytes the response cache for cacheable functions can use.
+		ErrorResult SetResponseCacheSize(size_t maxBytes)
+		{
+			if(running) return ErrorResult::Listener_Started;
+			responseCache.SetMaxBytes(maxBytes);
+			return ErrorResult::Call_Ok;
+		}
+
+		// Set how long the response to a call with an idempotency key is kept for retries of that call.
+		//    Only functions added with AddFunction, that aren't cacheable, and the default function are deduplicated.
+		// windowSeconds : how long a response is kept
+		// maxBytes : the most bytes the kept responses can use, the least recently used go first
+		ErrorResult SetDedupeWindow(float windowSeconds, size_t maxBytes)
+		{
+			if(running) return ErrorResult::Listener_Started;
+			dedupeWindowSeconds = windowSeconds;
+			dedupeCache.SetMaxBytes(maxBytes);
+			return ErrorResult::Call_Ok;
+		}
+
+		// Set the socket options for the listening connection and the connections it accepts.
+		ErrorResult SetSocketOptions(SocketOptions const &options)
+		{
+			if(running) return ErrorResult::Listener_Started;
+			socketOptions = options;
+			return ErrorResult::Call_Ok;
+		}
+
+		// Set how many helper threads are started with the listener, with the buffers a call needs already made,
+		//    so the first calls after Start don't wait for them. They wait for calls until the listener stops and
+		//    count against helperNum.
+		ErrorResult SetWarmThreads(uint32_t count)
+		{
+			if(running) return ErrorResult::Listener_Started;
+			warmThreadCount = count;
+			return ErrorResult::Call_Ok;
+		}
+
+		// Set the limits on the connections waited on without helper threads.
+		ErrorResult SetConnectionLimits(ConnectionLimits const &limits)
+		{
+			if(running) return ErrorResult::Listener_Started;
+			connectionLimits = limits;
+			return ErrorResult::Call_Ok;
+		}
+
+		// Get how many connections are waited on without helper threads, the memory they hold and how many were
+		//    dropped for the limits. Can be called from any thread.
+		ConnectionStats GetConnectionStats(void) const
+		{
+			return { waitingCount, waitingHeldBytes, idleDropped, evicted };
+		}
+
+		// Add another port to listen on next to the one passed to Start, with the connection class T. Every
+		//    endpoint feeds the same functions and helper threads.
+		template <typename T>
+		ErrorResult AddEndpoint(uint16_t port)
+		{
+			if(running) return ErrorResult::Listener_Started;
+			endpoints.push_back({ std::unique_ptr<ConnectionBase>(new T()), port });
+			return ErrorResult::Call_Ok;
+		}
+
+		// Add another port to listen on with the default connection class.
+		ErrorResult AddEndpoint(uint16_t port);
+
+		// Add a unix socket to listen on, requesters reach it with "unix:" and the path as the address.
+		// path : where the unix socket is made, whatever was there is removed
+		ErrorResult AddLocalEndpoint(std::string const &path);
+
+		// Set the unix socket path used to hand the listening sockets from one process to the next, for restarts
+		//    without refusing connections. Start takes the sockets over from a listener on the same port that is
+		//    serving the path, the endpoints are matched in the order they were added, and then serves the path
+		//    itself. A listener that handed off stops accepting and HandedOff turns true, its process should
+		//    then Stop to drain its calls and exit.
+		// path : the path of the unix socket, empty to turn hand offs off
+		ErrorResult SetHandOffPath(std::string const &path)
+		{
+			if(running) return ErrorResult::Listener_Started;
+			handOffPath = path;
+			return ErrorResult::Call_Ok;
+		}
+
+		// return : true once another process has taken the listening socket over
+		bool HandedOff(void) const { return handedOff; }
+
 		// Set the connection class to use.
 		template <typename T>
 		ErrorResult SetConnectionType(void)
@@ -141,16 +937,76 @@ namespace netfunc
 		//    if this is 0, no threads will be created and all work will be done on the calls to Update
 		//    if otherwise, a thread will be created for accepting and processing requests as needed
 		// acceptQueueSize : size of the accept queue passed into Listen
-		// timeoutSeconds : the maximum amount of time a connection should wait for data from the requester
-		//    only used if helperNum is not 0
+		// timeoutSeconds : the maximum amount of time a connection should wait for data from the requester, and
+		//    for a listener that is handing off to send the listening socket
 		ErrorResult Start(uint16_t port, uint16_t helperNum, uint16_t acceptQueueSize, float timeoutSeconds = 1.0f);
 
-		// Stops the listener port and waits for all threads to finish.
-		void Stop(void);
+		// Stops accepting right away, lets the calls in flight finish and waits for all threads to finish.
+		// drainSeconds : how long calls in flight get before their waits for the requester give up, a function
+		//    that is still running after that is waited for
+		void Stop(float drainSeconds = 5.0f);
+
+		// Drops the cached responses of a function and tells requesters with cached results for it that they are
+		//    no longer valid. Can be called while the listener is running.
+		// name : the name bound to the function
+		void Invalidate(std::string const &name);
 
-		// Trys to accept and process requests.
+		// Trys to accept and process requests. Without helper threads every connection is a small state machine,
+		//    each call reads whatever requests have fully arrived, answers them and goes on, so a slow requester
+		//    doesn't hold up the others. Stop should be called from the thread that calls Update.
 		// timeoutSeconds : the amount of time that should pass before the function stops accepting new requests and return
 		ErrorResult Update(float timeoutSeconds);
+
+		// Gets a descriptor that polls readable when Update has something to do, so the listener can be added
+		//    to an outside poll or epoll loop without threads. Update should still be called every so often, so
+		//    connections that ran out of time are dropped. Only there without helper threads.
+		// return : the descriptor, or -1 if there is none
+		int PollHandle(void) const { return maxThreadCount == 0 ? pollSet : -1; }
+	};
+
+	// How a blocking call is retried after network errors and timeouts. Retries wait a random time up to a
+	//    limit that doubles every attempt, and are paid for from a budget shared by all requests, so retries
+	//    can't multiply the load on a listener that is already struggling. Calls that can be retried carry an
+	//    idempotency key, the listener uses it to answer a retry of a call that already ran with its response.
+	struct RetryPolicy
+	{
+		// 1 doesn't retry
+		uint32_t maxAttempts = 1;
+		float baseBackoffSeconds = 0.05f;
+		float maxBackoffSeconds = 2.0f;
+		// every call earns this much of a retry, a retry is only made with a whole one saved up
+		float budgetFraction = 0.1f;
+	};
+
+	// When calls to a listener keep failing, more calls to it fail right away for a while instead of each one
+	//    waiting out its timeout. Once the time is up one call is let through as a probe, if it works calls go
+	//    through again, if not the wait starts over. Breakers are kept per address and port for the whole process.
+	struct CircuitBreakerPolicy
+	{
+		// network errors or timeouts in a row that open the circuit, 0 turns the breakers off
+		uint32_t failureThreshold = 0;
+		// how long an open circuit fails calls before letting a probe through
+		float openSeconds = 5.0f;
+	};
+
+	enum class CircuitState
+	{
+		Closed,   // calls go through
+		Open,     // calls fail with Circuit_Open
+		HalfOpen, // one probe call is going through, the rest fail
+	};
+
+	// What the circuit breaker of one listener has seen.
+	struct EndpointStats
+	{
+		std::string address;
+		uint16_t port;
+		CircuitState state;
+		uint32_t consecutiveFailures;
+		uint64_t successes;
+		uint64_t failures;
+		// calls failed with Circuit_Open without being made
+		uint64_t rejected;
 	};
 
 	class Request
@@ -158,9 +1014,75 @@ namespace netfunc
 		std::unique_ptr<ConnectionBase> connection = nullptr;
 		StringSerializationType serializeFunction = nullptr;
 		StringDeserializationType deserializeFunction = nullptr;
+		bool useCache = false;
+		bool uploadOpen = false;
+		float heartbeatSeconds = 0.0f;
+		SocketOptions socketOptions;
+		RetryPolicy retryPolicy;
+		// cleared by Cancel, kept behind a pointer so requests stay movable
+		std::unique_ptr<std::atomic_bool> running = std::unique_ptr<std::atomic_bool>(new std::atomic_bool(true));
+
+		ErrorResult HelperDefaults(void);
+		ErrorResult HelperProbe(std::string const &address, uint16_t port, float timeoutSeconds);
+		friend class Client;
 	public:
 		// The returned json from the remote function
-		nlohmann::json result;
+		json result;
+
+		// Attachments sent with the args on the next call, and the ones that came back with the result.
+		//    The returned ones point into a buffer this request keeps until the next call.
+		Attachments argAttachments;
+		Attachments resultAttachments;
+
+		~Request() { if(uploadOpen) connection->Stop(); }
+
+		// Serve calls to cacheable functions from a cache shared by all requests. How long a result stays valid is
+		//    decided by the listener, which also tells the cache when results have been invalidated.
+		void SetUseCache(bool use)
+		{
+			useCache = use;
+		}
+
+		// Set the maximum number of bytes the shared request cache can use, existing entries are dropped.
+		static void SetCacheSize(size_t maxBytes);
+
+		// Set how long the default connection keeps the addresses a host name resolved to. Once they are older
+		//    they are still used while a lookup in the background refreshes them.
+		static void SetResolveTtl(float ttlSeconds);
+
+		// Set the circuit breaker policy for blocking Send, SendStream and SendForFile calls of all requests.
+		static void SetCircuitBreaker(CircuitBreakerPolicy const &policy);
+
+		// Get the circuit breaker state of every listener called since the breakers were turned on.
+		static std::vector<EndpointStats> GetEndpointStats(void);
+
+		// Stop the blocking call in progress on this object from another thread, it returns Request_Timeout.
+		//    If no call is in progress the next one stops instead. Uploads and calls that don't wait aren't affected.
+		void Cancel(void)
+		{
+			*running = false;
+		}
+
+		// Set the socket options for the connections this object makes, starting with the next call.
+		void SetSocketOptions(SocketOptions const &options)
+		{
+			socketOptions = options;
+		}
+
+		// Ask the listener to send heartbeats while the function of a blocking Send or SendForFile runs. A call
+		//    whose listener picked it up and then stays silent for three intervals fails with Net_Error instead of
+		//    waiting out its timeout. Listeners that don't send heartbeats get the whole timeout.
+		// intervalSeconds : time between heartbeats, 0 turns them off
+		void SetHeartbeat(float intervalSeconds)
+		{
+			heartbeatSeconds = intervalSeconds;
+		}
+
+		// Set how Send retries calls that fail with network errors or time out. Each attempt gets the whole timeout.
+		void SetRetryPolicy(RetryPolicy const &policy)
+		{
+			retryPolicy = policy;
+		}
 
 		// Set the string serialization functions for this object, make sure they match the ones that the other side uses.
 		void SetStringSerializations(StringSerializationType serializeFunc, StringDeserializationType deserializeFunc)
@@ -183,7 +1105,144 @@ namespace netfunc
 		//    if true, function will block
 		//    if false, function will spawn a detached thread that handles the function call. there will not be a result
 		// timeoutSeconds : if waitForResult is true, this is the maximum amount of time that the function can take to execute
-		ErrorResult Send(std::string const &address, uint16_t port, std::string const &name, nlohmann::json const &args, bool waitForResult, float timeoutSeconds);
+		ErrorResult Send(std::string const &address, uint16_t port, std::string const &name, json const &args, bool waitForResult, float timeoutSeconds);
+
+		// Send a request to a streaming function on a listening connection and block while its chunks arrive.
+		//    Once the function is done its result is in result.
+		// address, port : location to try to connect to
+		// name : the name bound to the function on the listening connection
+		// args : the arguments that are passed to the function
+		// onChunk : called with each chunk in order, return false to stop the stream
+		// timeoutSeconds : the maximum amount of time to wait for the next chunk
+		// window : how many chunks the function can send before it has to wait for onChunk to catch up
+		ErrorResult SendStream(std::string const &address, uint16_t port, std::string const &name, json const &args,
+			std::function<bool(json const &chunk)> const &onChunk, float timeoutSeconds, uint32_t window = 16);
+
+		// Send a request to a file function on a listening connection and block while the file arrives.
+		//    Once it has all arrived the function's result is in result.
+		// address, port : location to try to connect to
+		// name : the name bound to the function on the listening connection
+		// args : the arguments that are passed to the function
+		// onData : called with each piece of the file in order, return false to stop receiving it
+		// timeoutSeconds : the maximum amount of time to wait for the result or the next piece
+		ErrorResult SendForFile(std::string const &address, uint16_t port, std::string const &name, json const &args,
+			std::function<bool(char const *data, size_t sizeBytes)> const &onData, float timeoutSeconds);
+
+		// Open a call to an upload function on a listening connection. The function starts right away, the rest
+		//    of its args are sent with WriteChunk and the result is collected with FinishUpload.
+		// address, port : location to try to connect to
+		// name : the name bound to the function on the listening connection
+		// args : the arguments that are passed to the function when it starts
+		// timeoutSeconds : the maximum amount of time to wait for the connection
+		ErrorResult OpenUpload(std::string const &address, uint16_t port, std::string const &name, json const &args,
+			float timeoutSeconds = 5.0f);
+
+		// Send the next chunk of args to the upload function opened with OpenUpload.
+		//    This blocks while the function is too far behind reading the chunks.
+		ErrorResult WriteChunk(json const &chunk);
+
+		// Tell the upload function that all the chunks have been sent and wait for it to finish.
+		// timeoutSeconds : the maximum amount of time to wait for the result
+		ErrorResult FinishUpload(float timeoutSeconds);
+	};
+
+	// Sends calls to one of a set of listeners that all serve the same functions. Each call looks at two endpoints
+	//    picked at random and goes to the less loaded one. Endpoints that time out or fail with network errors
+	//    are left out for a while, so one degraded listener doesn't hold up a share of all the calls.
+	class Client
+	{
+		static const size_t maxLatencySamples = 512;
+		static const size_t minLatencySamples = 32;
+	public:
+		enum class Balance
+		{
+			Outstanding, // fewest calls in flight, ties go to the lower average latency
+			Latency,     // lowest average latency scaled by the calls in flight
+		};
+	private:
+		struct Endpoint
+		{
+			std::string address;
+			uint16_t port;
+			uint32_t outstanding;
+			// moving average of successful calls, 0 until there is one
+			double latencySeconds;
+			uint32_t failures;
+			bool ejected;
+			std::chrono::steady_clock::time_point ejectedUntil;
+		};
+		std::mutex lock;
+		std::vector<Endpoint> endpoints;
+		uint64_t randomState;
+		Balance balance = Balance::Outstanding;
+		uint32_t failuresToEject = 2;
+		float ejectSeconds = 5.0f;
+		float maxEjectedFraction = 0.5f;
+
+		// recent latencies of successful calls, hedges go out once a call is slower than the percentile of them
+		std::vector<double> latencySamples;
+		size_t nextSample = 0;
+		size_t samplesSinceEstimate = 0;
+		double hedgeDelaySeconds = 0.0;
+		float hedgePercentile = 0.95f;
+		// every call earns this much of a hedge, a hedge is only sent with a whole one saved up
+		float hedgeBudget = 0.05f;
+		double hedgeTokens = 0.0;
+
+		size_t HelperPick(size_t exclude);
+		void HelperFinish(size_t index, ErrorResult result, double seconds, bool cancelled);
+	public:
+		Client();
+		Client(Client&) = delete;
+		void operator=(Client&) = delete;
+
+		// Add a listener calls can be sent to.
+		void AddEndpoint(std::string const &address, uint16_t port);
+
+		// Set how the less loaded of the two endpoints is decided.
+		void SetBalance(Balance policy);
+
+		// Set when endpoints are left out.
+		// failures : how many timeouts or network errors in a row leave an endpoint out
+		// seconds : how long it is left out before it gets calls again
+		// maxFraction : the most endpoints that can be left out at once, as a fraction of all of them
+		void SetEjection(uint32_t failures, float seconds, float maxFraction = 0.5f);
+
+		// Set when SendHedged sends a second copy of a call.
+		// percentile : a copy goes out once the call is slower than this fraction of recent calls, like 0.95
+		// maxExtraFraction : the most extra calls hedging can add, as a fraction of all calls, like 0.05
+		void SetHedging(float percentile, float maxExtraFraction);
+
+		// Get the endpoints ready before calls go out. Each one is connected to a few times, so host names are
+		//    looked up, buffers are made and the route is known before the first call. An endpoint that can't be
+		//    reached counts as a failed call, so it can be left out before calls are sent to it.
+		// request : the request whose connection class and socket options are used
+		// connectionsPerEndpoint : how many connections are opened to each endpoint
+		// timeoutSeconds : the maximum amount of time each connection can take
+		// return : how many endpoints could be reached
+		size_t Warm(Request &request, uint32_t connectionsPerEndpoint, float timeoutSeconds);
+
+		// Run a call against the endpoint picked for it and keep track of how it went. Any of Request's calls can
+		//    be routed this way.
+		// call : makes the call to the given address and port and returns its result
+		// return : what call returned, or Invalid_Address if there are no endpoints
+		ErrorResult Route(std::function<ErrorResult(std::string const &address, uint16_t port)> const &call);
+
+		// Send a blocking request through request to the endpoint picked for it, the result ends up in request.result.
+		// request : the request to send with, its settings and attachments are used as they are
+		// name : the name bound to the function on the listening connections
+		// args : the arguments that are passed to the function
+		// timeoutSeconds : the maximum amount of time the call can take
+		ErrorResult Send(Request &request, std::string const &name, json const &args, float timeoutSeconds);
+
+		// Send a blocking request like Send, and if it is slow send a copy to another endpoint. The first answer is
+		//    kept and the other call is cancelled. Only use this for functions that are safe to run twice.
+		// request : the request to send with, the result ends up in request.result whichever call answered
+		// hedge : a second request set up like request, with the same attachments, used for the copy
+		// name : the name bound to the function on the listening connections
+		// args : the arguments that are passed to the function
+		// timeoutSeconds : the maximum amount of time each call can take
+		ErrorResult SendHedged(Request &request, Request &hedge, std::string const &name, json const &args, float timeoutSeconds);
 	};
 };
 
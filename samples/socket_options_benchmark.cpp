@@ -0,0 +1,166 @@
+/*
+	This example measures what each socket option does for a few kinds of calls.
+	Every profile gets its own listener and requests with the same options, then times
+	a call with an attachment, a stream of small chunks and a large file result.
+	Calls with attachments and streams send several small messages in a row, which is
+	where Nagle and delayed acks show up. The file shows what the buffer sizes do.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../netfunc.h"
+
+namespace
+{
+	const uint32_t callCount = 21;
+	const uint32_t chunkCount = 200;
+	const uint64_t fileBytes = 16 * 1024 * 1024;
+	int fileDescriptor = -1;
+
+	void EchoFunction(nlohmann::json const &args, netfunc::Attachments const &argAttachments, nlohmann::json &result,
+		netfunc::Attachments &resultAttachments)
+	{
+		for(size_t i = 0; i < argAttachments.Count(); ++i)
+			resultAttachments.AddView(argAttachments.Name(i), argAttachments.Data(i), argAttachments.SizeBytes(i));
+	}
+
+	void ChunkFunction(nlohmann::json const &args, netfunc::StreamWriter &writer, nlohmann::json &result)
+	{
+		for(uint32_t i = 0; i < chunkCount; ++i)
+		{
+			nlohmann::json chunk;
+			chunk.emplace("number", i);
+			if(!writer.Write(chunk))
+				break;
+		}
+	}
+
+	void FileFunction(nlohmann::json const &args, nlohmann::json &result, netfunc::FileRange &file)
+	{
+		file.fd = fileDescriptor;
+		file.sizeBytes = fileBytes;
+	}
+
+	double SecondsSince(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	void RunProfile(std::string const &name, netfunc::SocketOptions const &options, uint16_t port)
+	{
+		netfunc::Listener server;
+		server.AddAttachmentFunction("echo", EchoFunction);
+		server.AddStreamFunction("chunks", ChunkFunction);
+		server.AddFileFunction("file", FileFunction);
+		server.SetSocketOptions(options);
+		// every call keeps its helper thread a while after answering, so have enough of them
+		if(server.Start(port, 64, 64) != netfunc::ErrorResult::Call_Ok)
+		{
+			std::cout << name << ": failed to start listener\n";
+			return;
+		}
+
+		std::vector<double> callTimes;
+		std::string payload(1024, 'x');
+		for(uint32_t i = 0; i < callCount; ++i)
+		{
+			netfunc::Request request;
+			request.SetSocketOptions(options);
+			request.argAttachments.AddView("payload", payload.data(), payload.size());
+			auto start = std::chrono::steady_clock::now();
+			if(request.Send("127.0.0.1", port, "echo", nlohmann::json::object(), true, 2.0f) == netfunc::ErrorResult::Call_Ok)
+				callTimes.push_back(SecondsSince(start));
+		}
+		std::sort(callTimes.begin(), callTimes.end());
+		double medianCall = callTimes.empty() ? 0.0 : callTimes[callTimes.size() / 2];
+
+		double streamSeconds = 0.0;
+		{
+			netfunc::Request request;
+			request.SetSocketOptions(options);
+			auto start = std::chrono::steady_clock::now();
+			auto onChunk = [](nlohmann::json const &chunk) { return true; };
+			if(request.SendStream("127.0.0.1", port, "chunks", nlohmann::json::object(), onChunk, 2.0f) == netfunc::ErrorResult::Call_Ok)
+				streamSeconds = SecondsSince(start);
+		}
+
+		double fileSeconds = 0.0;
+		{
+			netfunc::Request request;
+			request.SetSocketOptions(options);
+			uint64_t received = 0;
+			auto onData = [&received](char const *data, size_t sizeBytes) { received += sizeBytes; return true; };
+			auto start = std::chrono::steady_clock::now();
+			if(request.SendForFile("127.0.0.1", port, "file", nlohmann::json::object(), onData, 5.0f) == netfunc::ErrorResult::Call_Ok
+				&& received == fileBytes)
+				fileSeconds = SecondsSince(start);
+		}
+
+		std::printf("%-18s %10.1f us %10.2f ms %10.1f MiB/s\n", name.c_str(), medianCall * 1e6, streamSeconds * 1e3,
+			fileSeconds > 0.0 ? fileBytes / fileSeconds / (1024.0 * 1024.0) : 0.0);
+		server.Stop();
+	}
+}
+
+int main(void)
+{
+	std::FILE *file = std::tmpfile();
+	if(file == nullptr)
+	{
+		std::cout << "failed to make the file to send\n";
+		return 1;
+	}
+	std::vector<char> block(64 * 1024, 'f');
+	for(uint64_t written = 0; written < fileBytes; written += block.size())
+		std::fwrite(block.data(), 1, block.size(), file);
+	std::fflush(file);
+	fileDescriptor = fileno(file);
+
+	struct Profile
+	{
+		std::string name;
+		netfunc::SocketOptions options;
+	};
+	std::vector<Profile> profiles;
+	profiles.push_back({ "default", netfunc::SocketOptions() });
+	{
+		netfunc::SocketOptions options;
+		options.noDelay = true;
+		profiles.push_back({ "no delay", options });
+	}
+	{
+		netfunc::SocketOptions options;
+		options.quickAck = true;
+		profiles.push_back({ "quick ack", options });
+	}
+	{
+		netfunc::SocketOptions options;
+		options.busyPollMicroseconds = 50;
+		profiles.push_back({ "busy poll", options });
+	}
+	{
+		netfunc::SocketOptions options;
+		options.deferAcceptSeconds = 1;
+		profiles.push_back({ "defer accept", options });
+	}
+	{
+		netfunc::SocketOptions options;
+		options.sendBufferBytes = 4 * 1024 * 1024;
+		options.recvBufferBytes = 4 * 1024 * 1024;
+		profiles.push_back({ "4 MiB buffers", options });
+	}
+	profiles.push_back({ "latency preset", netfunc::SocketOptions::Latency() });
+	profiles.push_back({ "throughput preset", netfunc::SocketOptions::Throughput() });
+
+	std::printf("%-18s %13s %13s %16s\n", "profile", "median call", "stream", "file");
+	for(size_t i = 0; i < profiles.size(); ++i)
+		RunProfile(profiles[i].name, profiles[i].options, uint16_t(8000 + i));
+
+	std::fclose(file);
+	return 0;
+}
@@ -0,0 +1,72 @@
+/*
+	This example shows a function that sends its result in chunks as they are produced.
+	The requester gets each chunk as soon as it arrives instead of waiting for the whole
+	result, and the function waits if the requester falls too far behind.
+*/
+
+#include <iostream>
+#include <thread>
+#include "../netfunc.h"
+
+namespace
+{
+	netfunc::Listener server;
+
+	void CountFunction(nlohmann::json const &args, netfunc::StreamWriter &writer, nlohmann::json &result)
+	{
+		int32_t count = 0;
+		auto toRef = args.find("to");
+		int32_t to = (toRef != args.end()) ? int32_t(*toRef) : 0;
+		for(; count < to ; ++count)
+		{
+			nlohmann::json chunk;
+			chunk.emplace("number", count);
+			if(!writer.Write(chunk))
+				break;
+		}
+		result.emplace("sent", count);
+	}
+}
+
+int main(void)
+{
+	std::cout << "starting listener... ";
+	if(server.AddStreamFunction("count", CountFunction) != netfunc::ErrorResult::Call_Ok)
+	{
+		std::cout << "failed\n";
+		return 1;
+	}
+	if(server.Start(8000, 1, 10) != netfunc::ErrorResult::Call_Ok)
+	{
+		std::cout << "failed\n";
+		return 1;
+	}
+	std::cout << "good\n\n";
+
+	std::cout << "send request\n";
+	{
+		netfunc::Request request;
+		nlohmann::json args;
+		args.emplace("to", 10);
+		auto onChunk = [](nlohmann::json const &chunk)
+		{
+			std::cout << "got chunk " << int32_t(chunk["number"]) << "\n";
+			return true;
+		};
+		if(request.SendStream("127.0.0.1", 8000, "count", args, onChunk, 1.5f) != netfunc::ErrorResult::Call_Ok)
+		{
+			std::cout << "failed request\n";
+		}
+		else
+		{
+			auto sentRef = request.result.find("sent");
+			if(sentRef != request.result.end())
+				std::cout << "request has finished after " << int32_t(*sentRef) << " chunks\n";
+			else
+				std::cout << "request has no return\n";
+		}
+	}
+
+	server.Stop();
+	return 0;
+}